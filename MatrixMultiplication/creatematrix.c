@@ -1,76 +1,295 @@
-/* Program that generates a square matrix of given size and stores it  */
-/* in a file. The program asks for the dimension of the matrix, the    */
-/* name of the file to store the matrix in and a random number seed.   */
- 
-/* Compile with  gcc -O3 creatematrix.c matrixutil.o -o creatematrix -lm  */
- 
+/* Program that generates a matrix of given size and stores it in a    */
+/* file. The size, the name of the file and the random number seed are */
+/* given on the command line, as in                                    */
+/*   creatematrix -n 50000 -o A.dat -s 1 -D normal                     */
+/* If the size or file name is missing the program asks for them.      */
+/* The matrix is square unless -m M gives it M rows and N columns.     */
+/* The elements come from the counter-based generator matrix_random,   */
+/* so every element depends only on the seed and its position, and the */
+/* same seed gives the same matrix whatever the layout and the number  */
+/* of threads or processes. -D chooses the distribution: small         */
+/* integers (the default), uniform in [-1,1) or normal.                */
+/* The matrix is written through a memory mapping of the file, so      */
+/* matrices bigger than the memory can be made. With -T tile it is     */
+/* stored in tiles of size tile*tile instead of row by row. The rows   */
+/* are filled in parallel by the OpenMP threads. With -t double the    */
+/* elements are stored as doubles, and with -t int8 as bytes, for the  */
+/* integer distribution. With -z density only that fraction of the     */
+/* elements, chosen at random, is nonzero, as in the sparse matrices   */
+/* for fox -sparse.                                                    */
+/* Compiled with -DWITH_MPI it can also be started on several          */
+/* processes, which each generate a band of rows and write it to their */
+/* own region of the file with MPI-IO.                                 */
+
+/* Compile with                                                        */
+/*   gcc -O3 -fopenmp creatematrix.c matrixutil.o -o creatematrix -lm  */
+/* or with                                                             */
+/*   mpicc -O3 -fopenmp -DWITH_MPI creatematrix.c matrixutil.o \       */
+/*         -o creatematrix -lm                                         */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <getopt.h>
+#ifdef WITH_MPI
+#include <mpi.h>
+#endif
 
-#include "matrixutil.h" 
+#include "matrixutil.h"
 //extern void write_matrix(float *M, int N);
 //extern int fwrite_matrix(float *M, int N, char *fn);
 
+const char *dist_names[] = {"int", "uniform", "normal"};
+
+
+/* Returns the element at index of a matrix with the given density,
+   which is zero unless a second random number, drawn with the
+   complemented seed, falls below the density */
+float sparse_random(uint64_t seed, int dist, double density,
+		    uint64_t index) {
+  if (density < 1.0 &&
+      0.5*(matrix_random(~seed, MATRIX_RAND_UNIFORM, index)+1.0) >= density)
+    return(0.0);
+  return(matrix_random(seed, dist, index));
+}
+
+/* Fills rows i0..i1-1 of the matrix with header hdr into D, which
+   holds the elements of the file from row i0 on. i0 must start a row
+   of tiles. Returns the checksum of the rows */
+uint64_t fill_rows(void *D, matrix_header_t *hdr, long i0, long i1,
+		   uint64_t seed, int dist, double density) {
+  long i, j, N = hdr->cols, base = matrix_index(hdr, i0, 0);
+  uint64_t sum = 0;
+  float x;
+  double xd;
+  int8_t xi;
+
+  if (hdr->type == MATRIX_DOUBLE) {
+#pragma omp parallel for private(j, xd) reduction(+:sum) schedule(dynamic, 16)
+    for (i=i0; i<i1; i++) {
+      for (j=0; j<N; j++) {
+	xd = sparse_random(seed, dist, density, (uint64_t) i*N+j);
+	((double *) D)[matrix_index(hdr, i, j)-base] = xd;
+	sum += matrix_checksum_d(&xd, 1, i*N+j);
+      }
+    }
+  } else if (hdr->type == MATRIX_INT8) {
+#pragma omp parallel for private(j, xi) reduction(+:sum) schedule(dynamic, 16)
+    for (i=i0; i<i1; i++) {
+      for (j=0; j<N; j++) {
+	xi = (int8_t) sparse_random(seed, dist, density, (uint64_t) i*N+j);
+	((int8_t *) D)[matrix_index(hdr, i, j)-base] = xi;
+	sum += matrix_checksum_i8(&xi, 1, i*N+j);
+      }
+    }
+  } else {
+#pragma omp parallel for private(j, x) reduction(+:sum) schedule(dynamic, 16)
+    for (i=i0; i<i1; i++) {
+      for (j=0; j<N; j++) {
+	x = sparse_random(seed, dist, density, (uint64_t) i*N+j);
+	((float *) D)[matrix_index(hdr, i, j)-base] = x;
+	sum += matrix_checksum(&x, 1, i*N+j);
+      }
+    }
+  }
+  return(sum);
+}
+
+
 int main(int argc, char** argv) {
- 
+
   int debug = 0;       /* Debug flag, prints the d first entries of the matrices */
   int limit=10;
   int i, j;            /* Loop indexes */
-  int seed;            /* Seed for random number generator */
-  int N;               /* Size of matrix */
-  float *X;            /* Created matrix */
+  long seed = 0;       /* Seed for random number generator */
+  int have_seed = 0;
+  int N = 0;           /* Size of matrix */
+  int M = 0;           /* Nr of rows, N if not given */
+  int tile = 0;        /* Tile size, 0 for row by row */
+  int dist = MATRIX_RAND_INT;  /* Distribution of the elements */
+  int type = MATRIX_FLOAT;     /* Type of the elements */
+  double density = 1.0;        /* Fraction of nonzero elements */
+  void *X;             /* Created matrix */
+  matrix_header_t hdr;
   char *fn;
-  char c;
+  int c;
+  int id = 0, nproc = 1;
+#ifdef WITH_MPI
+  MPI_File fh;
+  long rows, r0, r1, chunk, i0, i1;
+  uint64_t sum, all_sum;
+  char *buf;
+#endif
 
-  /* Parse arguments to see if we have a -v or -d flag */
-  while ((c=getopt(argc, argv, "hd:")) != -1) {
+#ifdef WITH_MPI
+  MPI_Init(&argc, &argv);
+  MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+  MPI_Comm_rank(MPI_COMM_WORLD, &id);
+#endif
+
+  /* Allocate space for filename */
+  fn = (char *) malloc(sizeof(char)*256);
+  fn[0] = '\0';
+
+  /* Parse arguments */
+  while ((c=getopt(argc, argv, "hd:m:n:o:s:D:T:t:z:")) != -1) {
     switch (c) {
     case 'd':
       debug = 1;              /* Set debug flag */
       limit = atoi(optarg);   /* Get the argument to -d  */
       break;
+    case 'm':
+      M = atoi(optarg);
+      break;
+    case 'n':
+      N = atoi(optarg);
+      break;
+    case 'o':
+      strncpy(fn, optarg, 255);
+      fn[255] = '\0';
+      break;
+    case 's':
+      seed = atol(optarg);
+      have_seed = 1;
+      break;
+    case 'D':
+      for (dist=0; dist<3 && strcmp(optarg, dist_names[dist]); dist++);
+      if (dist == 3) {
+	if (id == 0) printf("Unknown distribution %s\n", optarg);
+	exit(1);
+      }
+      break;
+    case 'T':
+      tile = atoi(optarg);    /* Store the matrix in tiles */
+      break;
+    case 't':
+      if (!strcmp(optarg, "double")) type = MATRIX_DOUBLE;
+      else if (!strcmp(optarg, "float")) type = MATRIX_FLOAT;
+      else if (!strcmp(optarg, "int8")) type = MATRIX_INT8;
+      else {
+	if (id == 0) printf("Unknown element type %s\n", optarg);
+	exit(1);
+      }
+      break;
+    case 'z':
+      density = atof(optarg);   /* Make a sparse matrix */
+      break;
     case 'h':
-      printf("Usage: creatematrix [-d N]\n");
-      printf("       where\n");
-      printf("        -d N   -- debug, print N by N first etries of the matrices\n");
-      printf("        -h     -- help, print this message\n\n");
+      if (id == 0) {
+	printf("Usage: creatematrix [-n N] [-m M] [-o file] [-s seed] [-D dist]\n");
+	printf("                    [-T tile] [-t type] [-z density] [-d N]\n");
+	printf("       where\n");
+	printf("        -n N    -- size of the matrix, its nr of columns with -m\n");
+	printf("        -m M    -- nr of rows, for an M*N matrix\n");
+	printf("        -o file -- file to store the matrix in\n");
+	printf("        -s seed -- random number seed\n");
+	printf("        -D dist -- distribution of the elements: int (-3..6, default),\n");
+	printf("                   uniform (in [-1,1)) or normal (mean 0, variance 1)\n");
+	printf("        -T tile -- store the matrix in tiles of size tile*tile\n");
+	printf("        -t type -- element type, float (default), double or int8\n");
+	printf("        -z density -- fraction of nonzero elements, default 1\n");
+	printf("        -d N   -- debug, print N by N first entries of the matrices\n");
+	printf("        -h     -- help, print this message\n\n");
+      }
       exit(0);
     }
   }
-  
-  /* Allocate space for filename */
-  fn = (char *) malloc(sizeof(char)*80);
-  
-  printf("Give dimension of matrix: ");
-  scanf("%d",&N);
-  if (N<limit) limit=N;   /* limit = min(N,limit) */
-
-  printf("Give name of file to store matrix in: ");
-  scanf("%s", fn);
- 
-  printf("Give random seed: ");
-  scanf("%d",&seed);
-  srand (seed);
- 
-  /* Allocate space for matrix */
-  X = (float *) malloc(sizeof(float)*N*N);
- 
-  /* Assign random values to the matrix */
-  for (i=0; i<N; i++) {
-    for (j=0; j<N; j++) {
-      X[i*N+j] = (float)(rand()%10)-3.0;
+
+  /* Ask for what wasn't given on the command line */
+  if (N <= 0 || fn[0] == '\0') {
+    if (nproc > 1) {
+      if (id == 0) printf("Give the size and file with -n and -o\n");
+      exit(1);
+    }
+    if (N <= 0) {
+      printf("Give dimension of matrix: ");
+      scanf("%d",&N);
+    }
+    if (fn[0] == '\0') {
+      printf("Give name of file to store matrix in: ");
+      scanf("%255s", fn);
     }
+    if (!have_seed) {
+      printf("Give random seed: ");
+      scanf("%ld",&seed);
+    }
+  }
+  if (type == MATRIX_INT8 && dist != MATRIX_RAND_INT) {
+    if (id == 0) printf("Elements of type int8 need the int distribution\n");
+    exit(1);
   }
-  if (debug) {
-    printf ("First %d by %d elements of the matrix is\n", limit, limit);
-    write_matrix(X, limit);
+  if (M <= 0) M = N;
+  if (N<limit) limit=N;   /* limit = min(N,M,limit) */
+  if (M<limit) limit=M;
+  matrix_header(&hdr, type, M, N, (tile > 0) ? MATRIX_TILED : MATRIX_ROWMAJOR,
+		tile);
+
+  if (nproc == 1) {
+    /* Create the file, map it into memory and fill it in place */
+    X = matrix_create(fn, type, M, N, hdr.layout, tile);
+    if (X == NULL) exit(1);
+    fill_rows(X, &hdr, 0, M, seed, dist, density);
+    /* Store the checksum and close the file */
+    matrix_unmap(X, 1);
+  }
+#ifdef WITH_MPI
+  else {
+    /* Every process gets a band of whole rows of tiles, which is a */
+    /* contiguous region of the file in both layouts, and writes it */
+    /* in chunks of one row of tiles, or of rows of about 16 MB     */
+    chunk = (tile > 0) ? tile : (4L << 20)/N+1;
+    rows = (M+chunk-1)/chunk;
+    r0 = (rows*id/nproc)*chunk;
+    r1 = (rows*(id+1)/nproc)*chunk;
+    if (r1 > M) r1 = M;
+    if (r0 > M) r0 = M;
+    buf = (char *) malloc(matrix_elem_size(type)*chunk*N);
+    if (MPI_File_open(MPI_COMM_WORLD, fn, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+		      MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+      if (id == 0) printf("Couldn't open file %s\n", fn);
+      MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_File_set_size(fh, MATRIX_HEADER_SIZE+
+		      (MPI_Offset) matrix_elem_size(type)*M*N);
+    sum = 0;
+    for (i0=r0; i0<r1; i0+=chunk) {
+      i1 = (i0+chunk < r1) ? i0+chunk : r1;
+      sum += fill_rows(buf, &hdr, i0, i1, seed, dist, density);
+      MPI_File_write_at(fh, MATRIX_HEADER_SIZE+(MPI_Offset)
+			matrix_elem_size(type)*matrix_index(&hdr, i0, 0), buf,
+			(int) ((i1-i0)*N),
+			(type == MATRIX_DOUBLE) ? MPI_DOUBLE :
+			(type == MATRIX_INT8) ? MPI_INT8_T : MPI_FLOAT,
+			MPI_STATUS_IGNORE);
+    }
+    MPI_Reduce(&sum, &all_sum, 1, MPI_UINT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (id == 0) {
+      hdr.checksum = all_sum;
+      MPI_File_write_at(fh, 0, &hdr, sizeof(hdr), MPI_BYTE, MPI_STATUS_IGNORE);
+    }
+    MPI_File_close(&fh);
+    free(buf);
   }
- 
-  if (fwrite_matrix (X, N, fn)) {
-      printf("Wrote matrix to file %s\n\n", fn);
+#endif
+
+  if (debug && (id == 0)) {
+    X = matrix_map(fn, &hdr);
+    if (X != NULL) {
+      printf ("First %d by %d elements of the matrix is\n", limit, limit);
+      for (i=0; i<limit; i++) {
+	for (j=0; j<limit; j++) {
+	  printf(" %5.1f", matrix_get(X, hdr.type, matrix_index(&hdr, i, j)));
+	}
+	printf("\n");
+      }
+      matrix_unmap(X, 0);
+    }
   }
- 
+  if (id == 0) printf("Wrote %s matrix to file %s\n\n", dist_names[dist], fn);
+
+#ifdef WITH_MPI
+  MPI_Finalize();
+#endif
   exit(0);
 }
@@ -4,59 +4,3145 @@
 /* writes the result to a file.                                    */
 /* Mats Aspns 31.1.2000 */
 
-/* Compile with   'mpicc -O3 fox.c matrixutil.o -o fox -lm'  */
+/* Compile with   'mpicc -O3 -fopenmp fox.c matrixutil.o -o fox -lm'  */
+/* The options, which are described with the functions that        */
+/* implement them:                                                 */
+/*   -v, -d limit      verbose output, and the first entries       */
+/*   -b, -S, -t        local multiplication, see local_mult        */
+/*   -profile=file     tuned blocking parameters, see local_mult   */
+/*   -a alg,...        algorithms, see parse_algorithms            */
+/*   -c layers         2.5D algorithm, see mult_2_5d               */
+/*   -p                overlapped stages, see fox_stages_pipelined */
+/*   -ring[=segments]  see fox_stages_ring                         */
+/*   -sparse[=density] see fox_stages_sparse                       */
+/*   -compress         see fox_stages_compressed                   */
+/*   -shm[=group]      see shm_t                                   */
+/*   -s                serial I/O in process 0, see map_input      */
+/*   -batch manifest   see next_job and fox_plan_t                 */
+/*   -verify[=k]       see freivalds                               */
+/*   -stats=file       see write_stats                             */
+/*   -ooc[=tile]       see ooc_multiply                            */
+/*   -lu[=block]       see lu_run                                  */
+/*   -power=k, -chain=file see chain_t                             */
+/* The element type is chosen when compiling, see elem_t, and the  */
+/* modes are checked against each other in check_modes.            */
 
 #include <unistd.h>
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 #include <mpi.h>
 #include <math.h>
+#include <float.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef OPEN_MPI
+#include <mpi-ext.h>
+#endif
 
 #include "matrixutil.h"
 
+/* Persistent broadcasts came with MPI 4.0. Open MPI 4 has them as an
+   extension, with the prefix MPIX_. Without them the broadcasts of the
+   persistent Fox stages are started with MPI_Ibcast instead */
+#if MPI_VERSION >= 4
+#define HAVE_BCAST_INIT
+#elif defined(OMPI_HAVE_MPI_EXT_PCOLLREQ) && OMPI_HAVE_MPI_EXT_PCOLLREQ
+#define HAVE_BCAST_INIT
+#define MPI_Bcast_init MPIX_Bcast_init
+#endif
+
+/* Element types: elem_t for the matrices X and Y and acc_t for the
+   result Z, which the products are accumulated in. The MPI datatypes
+   and the local kernels are selected from these types. Floats are the
+   default, -DFOX_DOUBLE gives doubles and -DFOX_MIXED floats whose
+   products are accumulated in doubles. With -DFOX_INT8 the elements
+   are int8, accumulated in int32, for matrices of small integers such
+   as the ones creatematrix makes by default: the blocks are sent as
+   bytes, a quarter of the traffic of floats, and the result is exact.
+   Input files of another type are converted when read, and Strassen's
+   algorithm (-S) is only available for floats. */
+#if defined(FOX_DOUBLE)
+typedef double elem_t;
+typedef double acc_t;
+#define ELEM_NAME "double"
+#elif defined(FOX_MIXED)
+typedef float elem_t;
+typedef double acc_t;
+#define ELEM_NAME "float, accumulated in double"
+#elif defined(FOX_INT8)
+typedef int8_t elem_t;
+typedef int32_t acc_t;
+#define ELEM_NAME "int8, accumulated in int32"
+#else
+typedef float elem_t;
+typedef float acc_t;
+#define ELEM_NAME "float"
+#define FLOAT_KERNELS        /* matrixmult, Strassen etc. are for floats */
+#endif
+
+#define MPI_TYPE_OF(M) _Generic((M), float *: MPI_FLOAT, double *: MPI_DOUBLE, \
+				   int8_t *: MPI_INT8_T, int32_t *: MPI_INT32_T)
+#define MPI_ELEM MPI_TYPE_OF((elem_t *) NULL)
+#define MPI_ACC  MPI_TYPE_OF((acc_t *) NULL)
+
+const int datatag = 42;      /* Tag for message passing */
+
+/* Algorithms that can be selected with -a */
+enum { FOX, SUMMA, CANNON, TWO_HALF_D, NR_ALGORITHMS };
+const char *algorithm_names[NR_ALGORITHMS] = { "fox", "summa", "cannon",
+					       "2.5d" };
+#define MAX_RUNS 8           /* Max nr of algorithms given with -a */
+
+#define SUMMA_PANEL 256      /* Panel width in SUMMA if -b isn't given */
+#define SPARSE_THRESHOLD 0.05 /* Max density of sparse blocks with -sparse */
+#define OOC_TILE 1024        /* Default tile size of the out-of-core mode */
+#define RING_SEGMENTS 8      /* Default nr of segments with -ring */
+#define LU_BLOCK 64          /* Default block size of the LU factorization */
+#define MAX_CHAIN 64         /* Max nr of matrices with -chain */
+
+/* Options with long names, parsed with getopt_long_only so that they
+   can be given with a single dash as -verify */
+static struct option long_options[] = {
+  { "verify", optional_argument, NULL, 'V' },
+  { "profile", required_argument, NULL, 'P' },
+  { "batch", required_argument, NULL, 'B' },
+  { "sparse", optional_argument, NULL, 'Z' },
+  { "stats", required_argument, NULL, 'T' },
+  { "shm", optional_argument, NULL, 'M' },
+  { "ooc", optional_argument, NULL, 'O' },
+  { "compress", no_argument, NULL, 'K' },
+  { "ring", optional_argument, NULL, 'R' },
+  { "lu", optional_argument, NULL, 'L' },
+  { "power", required_argument, NULL, 'W' },
+  { "chain", required_argument, NULL, 'C' },
+  { NULL, 0, NULL, 0 }
+};
+
+/* Options for the local multiplication, set from the command line */
+int blocksize = 0;           /* Block size for matrixmult_block, 0 = off */
+int tuned = 0;               /* Blocking parameters loaded from a profile */
+int nthreads = 0;            /* Threads per process, 0 = no hybrid mode */
+int strassen_cutoff = 0;     /* Cutoff for matrixmult_strassen, 0 = off */
+float *strassen_work = NULL; /* Workspace for matrixmult_strassen */
+
+/* The modes of the run, set from the command line and checked
+   against each other in check_modes */
+int runs[MAX_RUNS] = { FOX };  /* Algorithms selected with -a */
+int nruns = 1;
+int replication = 1;         /* Nr of layers c for the 2.5D algorithm */
+int pipelined = 0;           /* Overlap communication and computation */
+int serial_io = 0;           /* Process 0 does all file I/O */
+int batch = 0;               /* Jobs read from a manifest */
+double sparse = 0.0;         /* Density threshold of sparse blocks */
+int use_shm = 0;             /* Shared memory windows for Fox */
+int compress = 0;            /* Compressed blocks in Fox */
+int ring = 0;                /* Segments of the ring broadcast */
+int ooc_tile = 0;            /* Tile size of the out-of-core mode */
+int lu_block = 0;            /* Block size of the LU factorization */
+int power = 0;               /* Power of X to compute with -power */
+char *chain_name = NULL;     /* File with the matrices of a chain */
+
+/* The part of a rows*cols matrix that is stored in one process, the
+   m*n elements from row row0 and column col0 on */
+typedef struct {
+  int rows, cols;              /* Size of the global matrix */
+  int m, n;                    /* Size of the local block */
+  int row0, col0;              /* Global index of its first row and column */
+} block_t;
+
+/* The p*q process grid, the communicators used by the algorithm and
+   the parts of the M*K matrix X, the K*N matrix Y and the M*N matrix Z
+   that are stored in this process. The rows of X and Z are split over
+   the process rows and the columns of Y and Z over the process columns,
+   while the inner dimension K is split over the columns for X and over
+   the rows for Y. For square matrices all three blocks are the same.
+   For the 2.5D algorithm there are c copies of the grid, called layers,
+   and grid_comm is the layer of this process */
+typedef struct {
+  MPI_Comm grid_comm;          /* Topology with grid structure */
+  MPI_Comm row_comm, col_comm; /* Communicators for row and column */
+  MPI_Comm depth_comm;         /* Same row and column in all layers */
+  int p, q;                    /* Process grid is of size p*q */
+  int c, my_layer;             /* Nr of layers and own layer */
+  int my_row, my_col;          /* Row and column number in process grid */
+  int source, dest;            /* Neighbours in the circular column shift */
+  int M, K, N;                 /* Size of global matrices */
+  int m_local, n_local;        /* Nr of rows and columns in local blocks */
+  int row0, col0;              /* Global index of first local row and column */
+  block_t x, y, z;             /* Local blocks of X, Y and Z */
+} grid_t;
+
 int min(int a, int b) {
   if (a<b) return(a);
   else return(b);
 }
 
+/* When n elements are divided as evenly as possible over p processes,
+   block_low gives the index of the first element in process i and
+   block_owner the process that holds element j */
+int block_low(int i, int p, int n) {
+  return((int) ((long) i*n/p));
+}
+
+int block_owner(int j, int p, int n) {
+  return((int) (((long) p*(j+1)-1)/n));
+}
+
+/* Sets b to the block of a rows*cols matrix that process (i,j) holds
+   in a p*q grid, with the rows divided over the process rows and the
+   columns over the process columns */
+void grid_block(block_t *b, int rows, int cols, int i, int j, int p, int q) {
+  b->rows = rows;
+  b->cols = cols;
+  b->row0 = block_low(i, p, rows);
+  b->col0 = block_low(j, q, cols);
+  b->m = block_low(i+1, p, rows)-b->row0;
+  b->n = block_low(j+1, q, cols)-b->col0;
+}
+
+/* Sets the sizes in the grid g to those of the product of an M*K and
+   a K*N matrix, with the blocks of X, Y and Z of this process */
+void grid_set_sizes(grid_t *g, int M, int K, int N) {
+  g->M = M;
+  g->K = K;
+  g->N = N;
+  grid_block(&g->x, M, K, g->my_row, g->my_col, g->p, g->q);
+  grid_block(&g->y, K, N, g->my_row, g->my_col, g->p, g->q);
+  grid_block(&g->z, M, N, g->my_row, g->my_col, g->p, g->q);
+  g->row0 = g->z.row0;
+  g->col0 = g->z.col0;
+  g->m_local = g->z.m;
+  g->n_local = g->z.n;
+}
+
+/* Timing of the stages of the algorithms, recorded with -stats. For
+   every stage the time spent in the collectives (the broadcasts, and
+   the reduction of the 2.5D algorithm), in the shifts and in the local
+   multiplication is recorded, with the bytes moved or the flops done.
+   In the overlapped variants the time of the shift is the time spent
+   waiting for all the communication of the stage after the local
+   multiplication. */
+enum { T_BCAST, T_SHIFT, T_COMPUTE, NR_TIMERS };
+
+typedef struct {
+  int stages, max_stages;       /* Nr of stages recorded and room */
+  double *time;                 /* NR_TIMERS times per stage */
+  double *amount;               /* Bytes, or flops for T_COMPUTE */
+} stage_stats_t;
+
+int record_stats = 0;           /* Set with -stats */
+stage_stats_t stats;
+
+/* Forgets the stages recorded in the previous run */
+void stats_reset(void) {
+  stats.stages = 0;
+}
+
+/* Adds the time since t0, and amount bytes or flops, to the given
+   timer of a stage. Returns the current time, to start the next timer */
+double stats_add(int stage, int kind, double t0, double amount) {
+  double t = MPI_Wtime();
+  int i;
+  if (!record_stats) return(t);
+  if (stage >= stats.max_stages) {
+    stats.max_stages = 2*stage+16;
+    stats.time = (double *) realloc(stats.time,
+				    sizeof(double)*NR_TIMERS*stats.max_stages);
+    stats.amount = (double *) realloc(stats.amount, sizeof(double)*
+				      NR_TIMERS*stats.max_stages);
+  }
+  for (; stats.stages <= stage; stats.stages++) {
+    for (i=0; i<NR_TIMERS; i++) {
+      stats.time[stats.stages*NR_TIMERS+i] = 0.0;
+      stats.amount[stats.stages*NR_TIMERS+i] = 0.0;
+    }
+  }
+  stats.time[stage*NR_TIMERS+kind] += t-t0;
+  stats.amount[stage*NR_TIMERS+kind] += amount;
+  return(t);
+}
+
+/* Parses a comma separated list of algorithm names into runs, as in
+   -a fox,cannon. The algorithms are run one after the other on the
+   same data, and their times and results are compared.
+   Returns the number of algorithms, or 0 if a name is unknown */
+int parse_algorithms(char *list, int *runs) {
+  int n = 0, a;
+  char *name;
+  for (name=strtok(list, ","); name != NULL; name=strtok(NULL, ",")) {
+    for (a=0; a<NR_ALGORITHMS; a++) {
+      if (strcmp(name, algorithm_names[a]) == 0) break;
+    }
+    if (a == NR_ALGORITHMS || n == MAX_RUNS) return(0);
+    runs[n++] = a;
+  }
+  return(n);
+}
+
+/* Reads the next job from the batch manifest in process 0 and gives
+   the file names to all processes. Every line of the manifest holds
+   the names of the files X, Y and Z of one multiplication Z = X*Y.
+   Empty lines and lines starting with # are skipped.
+   Returns 0 in all processes when there are no more jobs */
+int next_job(FILE *manifest, char *fn1, char *fn2, char *fn3, int id) {
+  char line[256];
+  int more = 0, n;
+
+  while (id == 0 && !more && manifest != NULL &&
+	 fgets(line, sizeof(line), manifest) != NULL) {
+    if (line[0] == '#') continue;
+    n = sscanf(line, "%79s %79s %79s", fn1, fn2, fn3);
+    if (n == 3) more = 1;
+    else if (n > 0) printf("Skipping job without three files: %s", line);
+  }
+  MPI_Bcast(&more, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (more) {
+    MPI_Bcast(fn1, 80, MPI_CHAR, 0, MPI_COMM_WORLD);
+    MPI_Bcast(fn2, 80, MPI_CHAR, 0, MPI_COMM_WORLD);
+    MPI_Bcast(fn3, 80, MPI_CHAR, 0, MPI_COMM_WORLD);
+  }
+  return(more);
+}
+
+/* Multiplies the M*K matrix X with the K*N matrix Y and adds the result
+   to Z. The matrices are stored by rows with row strides ldx, ldy, ldz */
+void local_gemm(int M, int N, int K, elem_t *X, int ldx, elem_t *Y, int ldy,
+		acc_t *Z, int ldz) {
+  if (nthreads > 0)
+    matrixmult_gemm_slice_t(M, N, K, X, ldx, Y, ldy, Z, ldz, blocksize);
+  else
+    matrixmult_gemm_t(M, N, K, X, ldx, Y, ldy, Z, ldz, blocksize);
+}
+
+/* Multiplies the local blocks X and Y of order N and adds the result
+   to Z. Uses Strassen's algorithm if a cutoff has been given with -S,
+   the threaded kernel in hybrid mode, otherwise the blocked kernel if a
+   block size has been given with -b or a tuning profile was loaded. For
+   other types than floats the blocked kernel is always used.
+   The profile is the one tunematrix has stored for the host of the
+   process, or the one given with -profile=file, or none with
+   -profile=none. In hybrid mode (-t nthreads) start one process per
+   socket or node, for instance
+     mpirun -np 4 --map-by ppr:1:socket:pe=16 ./fox -t 16
+   The accuracy of Strassen's algorithm relative to the blocked kernel
+   is reported after the run. */
+void local_mult(elem_t *X, elem_t *Y, acc_t *Z, int N) {
+#ifdef FLOAT_KERNELS
+  if (strassen_cutoff > 0)
+    matrixmult_strassen(X, Y, Z, N, strassen_cutoff, blocksize, strassen_work);
+  else if (nthreads > 0) matrixmult_slice(X, Y, Z, N, blocksize);
+  else if (blocksize > 0 || tuned) matrixmult_block(X, Y, Z, N, blocksize);
+  else matrixmult(X, Y, Z, N);
+#else
+  local_gemm(N, N, N, X, N, Y, N, Z, N);
+#endif
+}
+
+/* Multiplies the M*K block X with the K*N block Y, both stored without
+   gaps between the rows, and adds the result to Z. Square blocks are
+   multiplied with local_mult, so that Strassen's algorithm can be used */
+void local_mult_rect(int M, int N, int K, elem_t *X, elem_t *Y, acc_t *Z) {
+  if (M == N && N == K)
+    local_mult(X, Y, Z, N);
+  else
+    local_gemm(M, N, K, X, K, Y, N, Z, N);
+}
+
+
+/* Returns the MPI datatype of the elements of a matrix file */
+MPI_Datatype file_etype(int type) {
+  switch (type) {
+  case MATRIX_DOUBLE: return(MPI_DOUBLE);
+  case MATRIX_INT8:   return(MPI_INT8_T);
+  case MATRIX_INT32:  return(MPI_INT32_T);
+  default:            return(MPI_FLOAT);
+  }
+}
+
+
+/* Creates a datatype for the block b of a matrix with elements of
+   type etype */
+MPI_Datatype block_type(const block_t *b, MPI_Datatype etype) {
+  MPI_Datatype block;
+  int sizes[2], subsizes[2], starts[2];
+  sizes[0] = b->rows;
+  sizes[1] = b->cols;
+  subsizes[0] = b->m;
+  subsizes[1] = b->n;
+  starts[0] = b->row0;
+  starts[1] = b->col0;
+  MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C,
+			   etype, &block);
+  MPI_Type_commit(&block);
+  return(block);
+}
+
+
+/* Creates the file view and memory datatypes for the block b in a
+   tiled matrix file with header hdr. The pieces of the block are listed
+   in the order they are stored in the file, so the file view is
+   monotonic, and the memory type puts every piece in its place in the
+   row-major local block */
+void tiled_block_types(const block_t *b, matrix_header_t *hdr,
+		       MPI_Datatype etype, MPI_Datatype *file,
+		       MPI_Datatype *mem) {
+  long tile = hdr->tile, ti, tj, i, j0, j1;
+  long size = matrix_elem_size(hdr->type);
+  int n = 0, *lengths;
+  MPI_Aint *fdisp, *mdisp;
+
+  i = ((b->m+tile-1)/tile+1)*((b->n+tile-1)/tile+1)*tile;
+  lengths = (int *) malloc(sizeof(int)*i);
+  fdisp = (MPI_Aint *) malloc(sizeof(MPI_Aint)*i);
+  mdisp = (MPI_Aint *) malloc(sizeof(MPI_Aint)*i);
+  for (ti=b->row0/tile; ti*tile<b->row0+b->m; ti++) {
+    for (tj=b->col0/tile; tj*tile<b->col0+b->n; tj++) {
+      j0 = (tj*tile > b->col0) ? tj*tile : b->col0;
+      j1 = ((tj+1)*tile < b->col0+b->n) ? (tj+1)*tile : b->col0+b->n;
+      for (i=ti*tile; i<(ti+1)*tile && i<b->row0+b->m; i++) {
+	if (i < b->row0) continue;
+	lengths[n] = j1-j0;
+	fdisp[n] = size*matrix_index(hdr, i, j0);
+	mdisp[n] = size*((i-b->row0)*b->n+j0-b->col0);
+	n++;
+      }
+    }
+  }
+  MPI_Type_create_hindexed(n, lengths, fdisp, etype, file);
+  MPI_Type_create_hindexed(n, lengths, mdisp, etype, mem);
+  MPI_Type_commit(file);
+  MPI_Type_commit(mem);
+  free(lengths);
+  free(fdisp);
+  free(mdisp);
+}
+
+
+/* Returns the checksum of the local block M_local, the block b with
+   elements of the given type, in the whole matrix, summed over all
+   processes in the grid */
+uint64_t block_checksum(void *M_local, int type, const block_t *b,
+			grid_t *g) {
+  uint64_t sum = 0, all_sum;
+  long i, first;
+  for (i=0; i<b->m; i++) {
+    first = (long) (b->row0+i)*b->cols+b->col0;
+    sum += matrix_checksum_type((char *) M_local+(long) matrix_elem_size(type)*
+				i*b->n, type, b->n, first);
+  }
+  MPI_Allreduce(&sum, &all_sum, 1, MPI_UINT64_T, MPI_SUM, g->grid_comm);
+  return(all_sum);
+}
+
+
+/* Reads the block b of the matrix in file fn into M_local, with a
+   collective read on the grid communicator. The file may be stored row
+   by row or in tiles, and the checksum in its header is verified. Old
+   files without a header are read as floats row by row. Elements of
+   another type than elem_t are read into a temporary block and
+   converted.
+   Returns zero in all processes if the file couldn't be opened, is
+   too short or doesn't match the size of b, otherwise 1 */
+int mpiio_read_block(elem_t *M_local, char *fn, grid_t *g, const block_t *b) {
+  MPI_File fh;
+  MPI_Datatype block, etype, mem = MPI_DATATYPE_NULL;
+  MPI_Offset size, disp = 0;
+  matrix_header_t hdr;
+  int ok, all_ok, type, count = b->m*b->n;
+  void *buf;
+  long i;
+
+  if (MPI_File_open(g->grid_comm, fn, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh)
+      != MPI_SUCCESS) return(0);
+  MPI_File_get_size(fh, &size);
+  memset(&hdr, 0, sizeof(hdr));
+  if (size >= MATRIX_HEADER_SIZE)
+    MPI_File_read_at_all(fh, 0, &hdr, sizeof(hdr), MPI_BYTE,
+			 MPI_STATUS_IGNORE);
+  if (hdr.magic == MATRIX_MAGIC) {
+    disp = MATRIX_HEADER_SIZE;
+    if (!matrix_header_ok(&hdr) || hdr.rows != (uint64_t) b->rows ||
+	hdr.cols != (uint64_t) b->cols) {
+      MPI_File_close(&fh);
+      return(0);
+    }
+  }
+  type = (hdr.magic == MATRIX_MAGIC) ? (int) hdr.type : MATRIX_FLOAT;
+  etype = file_etype(type);
+  if (size < disp+(MPI_Offset) matrix_elem_size(type)*b->rows*b->cols) {
+    MPI_File_close(&fh);
+    return(0);
+  }
+  buf = (type == MATRIX_TYPE_OF(M_local)) ? (void *) M_local :
+    malloc(matrix_elem_size(type)*count);
+  if (hdr.magic == MATRIX_MAGIC && hdr.layout == MATRIX_TILED)
+    tiled_block_types(b, &hdr, etype, &block, &mem);
+  else
+    block = block_type(b, etype);
+  MPI_File_set_view(fh, disp, etype, block, "native", MPI_INFO_NULL);
+  if (mem != MPI_DATATYPE_NULL)
+    ok = (MPI_File_read_at_all(fh, 0, buf, 1, mem, MPI_STATUS_IGNORE)
+	  == MPI_SUCCESS);
+  else
+    ok = (MPI_File_read_at_all(fh, 0, buf, count, etype,
+			       MPI_STATUS_IGNORE) == MPI_SUCCESS);
+  MPI_File_close(&fh);
+  MPI_Type_free(&block);
+  if (mem != MPI_DATATYPE_NULL) MPI_Type_free(&mem);
+  MPI_Allreduce(&ok, &all_ok, 1, MPI_INT, MPI_LAND, g->grid_comm);
+  /* All processes have the same header, so they agree on the result */
+  if (all_ok && hdr.magic == MATRIX_MAGIC &&
+      block_checksum(buf, type, b, g) != hdr.checksum) {
+    if (g->my_row == 0 && g->my_col == 0)
+      printf("Checksum error in file %s\n", fn);
+    all_ok = 0;
+  }
+  if (buf != (void *) M_local) {
+    for (i=0; i<count; i++) M_local[i] = matrix_get(buf, type, i);
+    free(buf);
+  }
+  return(all_ok);
+}
+
+
+/* Writes M_local, the block b of a matrix, to its place in the file
+   fn, with a collective write on the grid communicator. Process 0 in
+   the grid writes the header with the checksum of the whole matrix.
+   The file is created if it doesn't exist.
+   Returns zero in all processes if the file couldn't be opened,
+   otherwise 1 */
+int mpiio_write_block(acc_t *M_local, char *fn, grid_t *g, const block_t *b) {
+  MPI_File fh;
+  MPI_Datatype block;
+  matrix_header_t hdr;
+  int ok, all_ok, rank;
+
+  matrix_header(&hdr, MATRIX_TYPE_OF(M_local), b->rows, b->cols,
+		MATRIX_ROWMAJOR, 0);
+  hdr.checksum = block_checksum(M_local, hdr.type, b, g);
+  if (MPI_File_open(g->grid_comm, fn, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+		    MPI_INFO_NULL, &fh) != MPI_SUCCESS) return(0);
+  /* Truncate an old file that may be bigger */
+  MPI_File_set_size(fh, MATRIX_HEADER_SIZE+
+		    (MPI_Offset) sizeof(acc_t)*b->rows*b->cols);
+  MPI_Comm_rank(g->grid_comm, &rank);
+  ok = 1;
+  if (rank == 0)
+    ok = (MPI_File_write_at(fh, 0, &hdr, sizeof(hdr), MPI_BYTE,
+			    MPI_STATUS_IGNORE) == MPI_SUCCESS);
+  block = block_type(b, MPI_ACC);
+  MPI_File_set_view(fh, MATRIX_HEADER_SIZE, MPI_ACC, block, "native",
+		    MPI_INFO_NULL);
+  ok = (MPI_File_write_at_all(fh, 0, M_local, b->m*b->n, MPI_ACC,
+			      MPI_STATUS_IGNORE) == MPI_SUCCESS) && ok;
+  MPI_File_close(&fh);
+  MPI_Type_free(&block);
+  MPI_Allreduce(&ok, &all_ok, 1, MPI_INT, MPI_LAND, g->grid_comm);
+  return(all_ok);
+}
+
+
+/* Returns the N*N matrix in file fn for process 0 with serial I/O.
+   Files of elem_t stored row by row are mapped into memory without
+   copying them, and *mapped is set. Tiled files, files of another type
+   and files without a header are read into a new matrix. Returns NULL
+   if the file couldn't be read */
+elem_t *map_input(char *fn, int N, int *mapped) {
+  matrix_header_t hdr;
+  elem_t *M;
+
+  M = matrix_map(fn, &hdr);
+  if (M != NULL && hdr.layout == MATRIX_ROWMAJOR &&
+      hdr.type == (uint32_t) MATRIX_TYPE_OF(M) &&
+      hdr.rows == (uint64_t) N && hdr.cols == (uint64_t) N) {
+    if (!matrix_verify(M, &hdr)) {
+      printf("Checksum error in file %s\n", fn);
+      matrix_unmap(M, 0);
+      return(NULL);
+    }
+    *mapped = 1;
+    return(M);
+  }
+  if (M != NULL) matrix_unmap(M, 0);
+  M = (elem_t *) malloc(sizeof(elem_t)*N*N);
+  if (!fread_matrix_t(M, N, fn)) {
+    free(M);
+    return(NULL);
+  }
+  *mapped = 0;
+  return(M);
+}
+
+
+/* Freivalds' check of the result Z = X*Y, distributed over the grid.
+   For a random vector r, Z*r is compared with X*(Y*r), which takes
+   O(N^2) operations instead of the O(N^3) of recomputing Z. The
+   products of the local blocks with the local parts of the vectors are
+   summed along the rows with row_comm, and the vector Y*r is gathered
+   along the columns with col_comm, since X needs it indexed by column.
+   The elements of r are drawn from the 2^24 values of matrix_random's
+   uniform distribution, so by the Schwartz-Zippel lemma the exact test
+   Z*r == X*(Y*r) misses a wrong Z with probability at most 2^-24 per
+   trial. To allow for rounding errors, row i passes instead if
+   |(Z*r)_i-(X*(Y*r))_i| is at most 4*K*eps*(|X|*(|Y|*|r|))_i, a bound
+   on the rounding error of the product, where eps is that of doubles
+   for an exact integer product. The probability bound doesn't hold for
+   this test: errors below the rounding bound are accepted by design,
+   and a bigger error in Z can give a difference below it with a much
+   higher probability.
+   Returns the largest ratio of the difference to this bound over all
+   rows and trials in all processes, so the check passes if it is at
+   most 1 */
+double freivalds(grid_t *g, elem_t *X_local, elem_t *Y_local, acc_t *Z_local,
+		 int trials, uint64_t seed) {
+  const int m = g->m_local, n = g->n_local, N = g->N, K = g->K;
+  const int kx = g->x.n, ky = g->y.m;   /* Columns of X and rows of Y */
+  const double eps = (sizeof(acc_t) == sizeof(double) || (acc_t) 0.5 == 0) ?
+    DBL_EPSILON : FLT_EPSILON;
+  double *r, *loc, *sum, *yr;   /* yr holds Y*r and |Y|*|r| for all K rows */
+  double ratio = 0.0, all_ratio, x, a, z, bound;
+  int trial, i, j;
+
+  r = (double *) malloc(sizeof(double)*n);
+  loc = (double *) malloc(sizeof(double)*(2*ky+2*m));
+  sum = (double *) malloc(sizeof(double)*(2*ky+m));
+  yr = (double *) malloc(sizeof(double)*2*K);
+
+  for (trial=0; trial<trials; trial++) {
+    /* Every process generates its own part of r */
+    for (j=0; j<n; j++)
+      r[j] = matrix_random(seed, MATRIX_RAND_UNIFORM,
+			   (uint64_t) trial*N+g->col0+j);
+
+    /* Y*r and |Y|*|r| for the rows of Y, and Z*r for the rows of Z,
+       of this process row */
+    for (i=0; i<ky; i++) {
+      x = a = 0.0;
+      for (j=0; j<n; j++) {
+	x += Y_local[(long) i*n+j]*r[j];
+	a += fabs(Y_local[(long) i*n+j])*fabs(r[j]);
+      }
+      loc[i] = x; loc[ky+i] = a;
+    }
+    for (i=0; i<m; i++) {
+      z = 0.0;
+      for (j=0; j<n; j++) z += Z_local[(long) i*n+j]*r[j];
+      loc[2*ky+i] = z;
+    }
+    MPI_Allreduce(loc, sum, 2*ky+m, MPI_DOUBLE, MPI_SUM, g->row_comm);
+
+    /* Every process row contributes its rows of Y*r and |Y|*|r| */
+    memset(yr, 0, sizeof(double)*2*K);
+    for (i=0; i<ky; i++) {
+      yr[g->y.row0+i] = sum[i];
+      yr[K+g->y.row0+i] = sum[ky+i];
+    }
+    MPI_Allreduce(MPI_IN_PLACE, yr, 2*K, MPI_DOUBLE, MPI_SUM, g->col_comm);
+
+    /* X*(Y*r) and |X|*(|Y|*|r|) */
+    for (i=0; i<m; i++) {
+      x = a = 0.0;
+      for (j=0; j<kx; j++) {
+	x += X_local[(long) i*kx+j]*yr[g->x.col0+j];
+	a += fabs(X_local[(long) i*kx+j])*yr[K+g->x.col0+j];
+      }
+      loc[i] = x; loc[m+i] = a;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, loc, 2*m, MPI_DOUBLE, MPI_SUM, g->row_comm);
+
+    for (i=0; i<m; i++) {
+      bound = 4.0*K*eps*loc[m+i]+DBL_MIN;
+      ratio = fmax(ratio, fabs(sum[2*ky+i]-loc[i])/bound);
+    }
+  }
+  MPI_Allreduce(&ratio, &all_ratio, 1, MPI_DOUBLE, MPI_MAX, g->grid_comm);
+
+  free(r);
+  free(loc);
+  free(sum);
+  free(yr);
+  return(all_ratio);
+}
+
+
+/* Fox's algorithm. In each of the q stages one process in every row
+   broadcasts its block of X along the row, all processes multiply it
+   with their current block of Y, and the blocks of Y are shifted one
+   step up in the columns. tmp is space for one received block.
+   The blocks may be rectangular, m*k for X, k*n for Y and m*n for Z. */
+void fox_stages(grid_t *g, elem_t *X_local, elem_t *Y_local, acc_t *Z_local,
+		elem_t *tmp, int verbose) {
+  const int m = g->m_local, k = g->x.n, n = g->n_local;
+  const double xbytes = sizeof(elem_t)*(double) m*k;
+  const double ybytes = sizeof(elem_t)*(double) k*n;
+  int stage, bcast_root;
+  double t;
+  MPI_Status status;
+
+  for (stage=0; stage<g->q; stage++) {
+    if (verbose) {
+      printf("    stage %d\n", stage);
+      fflush(stdout);
+    }
+
+    /* The process bcast_root does the broadcast in each stage */
+    bcast_root = (g->my_row+stage)%g->q;
+    t = MPI_Wtime();
+    if (bcast_root == g->my_col) {
+      MPI_Bcast(X_local, m*k, MPI_ELEM, bcast_root, g->row_comm);
+      t = stats_add(stage, T_BCAST, t, xbytes);
+      local_mult_rect(m, n, k, X_local, Y_local, Z_local);
+    } else {
+      MPI_Bcast(tmp, m*k, MPI_ELEM, bcast_root, g->row_comm);
+      t = stats_add(stage, T_BCAST, t, xbytes);
+      local_mult_rect(m, n, k, tmp, Y_local, Z_local);
+    }
+    t = stats_add(stage, T_COMPUTE, t, 2.0*m*n*(double) k);
+    MPI_Sendrecv_replace(Y_local, k*n, MPI_ELEM, g->dest, datatag,
+			 g->source, datatag, g->col_comm, &status);
+    stats_add(stage, T_SHIFT, t, ybytes);
+  }
+}
+
+
+/* Fox's algorithm with double buffering. The block of X for the next
+   stage is broadcast with MPI_Ibcast, and the shifted block of Y is
+   exchanged with MPI_Isend/MPI_Irecv, while the current blocks are
+   multiplied. How much of the communication is actually hidden depends
+   on the MPI library making progress in the background. Only the
+   broadcast of the first stage is a blocking MPI_Bcast, as there is
+   nothing to multiply before it has arrived.
+   On return Y_local holds the original block of Y, as in fox_stages. */
+void fox_stages_pipelined(grid_t *g, elem_t *X_local, elem_t *Y_local,
+			  acc_t *Z_local, int verbose) {
+  const int m = g->m_local, k = g->x.n, n = g->n_local;
+  const int nx = m*k, ny = k*n;  /* Nr of elements in the blocks */
+  int stage, root;
+  elem_t *Abuf[2], *Bbuf[2];    /* Current and next blocks of X and Y */
+  elem_t *A_cur, *A_next;
+  MPI_Request req[3];           /* Broadcast, send and receive */
+  const double xbytes = sizeof(elem_t)*(double) nx;
+  const double ybytes = sizeof(elem_t)*(double) ny;
+  double t;
+
+  Abuf[0] = (elem_t *) malloc(sizeof(elem_t)*nx);
+  Abuf[1] = (elem_t *) malloc(sizeof(elem_t)*nx);
+  Bbuf[0] = Y_local;
+  Bbuf[1] = (elem_t *) malloc(sizeof(elem_t)*ny);
+
+  /* Get the block of X for the first stage */
+  root = g->my_row%g->q;
+  A_cur = A_next = (root == g->my_col) ? X_local : Abuf[0];
+  t = MPI_Wtime();
+  MPI_Bcast(A_cur, nx, MPI_ELEM, root, g->row_comm);
+  stats_add(0, T_BCAST, t, xbytes);
+
+  for (stage=0; stage<g->q; stage++) {
+    elem_t *B_cur = Bbuf[stage%2], *B_next = Bbuf[(stage+1)%2];
+    int nreq = 0;
+    if (verbose) {
+      printf("    stage %d\n", stage);
+      fflush(stdout);
+    }
+
+    /* Start fetching the block of X for the next stage */
+    if (stage+1 < g->q) {
+      root = (g->my_row+stage+1)%g->q;
+      A_next = (root == g->my_col) ? X_local : Abuf[(stage+1)%2];
+      MPI_Ibcast(A_next, nx, MPI_ELEM, root, g->row_comm, &req[nreq++]);
+    }
+    /* Start shifting the current block of Y one step up */
+    MPI_Isend(B_cur, ny, MPI_ELEM, g->dest, datatag, g->col_comm,
+	      &req[nreq++]);
+    MPI_Irecv(B_next, ny, MPI_ELEM, g->source, datatag, g->col_comm,
+	      &req[nreq++]);
+
+    t = MPI_Wtime();
+    local_mult_rect(m, n, k, A_cur, B_cur, Z_local);
+    t = stats_add(stage, T_COMPUTE, t, 2.0*m*n*(double) k);
+
+    MPI_Waitall(nreq, req, MPI_STATUSES_IGNORE);
+    stats_add(stage, T_SHIFT, t, (nreq == 3) ? xbytes+ybytes : ybytes);
+    A_cur = A_next;
+  }
+
+  /* After q shifts the original block is in Bbuf[q%2] */
+  if (Bbuf[g->q%2] != Y_local) memcpy(Y_local, Bbuf[g->q%2], sizeof(elem_t)*ny);
+
+  free(Abuf[0]);
+  free(Abuf[1]);
+  free(Bbuf[1]);
+}
+
+/* Fox's algorithm with the block of X broadcast as a pipelined ring.
+   The block is split into nseg segments of whole rows, which the root
+   sends to its right neighbour in the row, and every process passes
+   them on to the next one, except the process left of the root. Each
+   segment is multiplied with the block of Y as soon as it has arrived
+   and been passed on, while the later segments are still on the way.
+   With enough segments the broadcast takes about the time of sending
+   the block once over one link, whatever the size q of the grid is.
+   The segments are multiplied with local_gemm, so Strassen's algorithm
+   (-S) isn't used. tmp is space for one received block. */
+void fox_stages_ring(grid_t *g, elem_t *X_local, elem_t *Y_local,
+		     acc_t *Z_local, elem_t *tmp, int nseg, int verbose) {
+  const int q = g->q, m = g->m_local, k = g->x.n, n = g->n_local;
+  const int right = (g->my_col+1)%q;
+  const double xbytes = sizeof(elem_t)*(double) m*k;
+  const double ybytes = sizeof(elem_t)*(double) k*n;
+  int stage, root, s, r0, r1, nsend;
+  MPI_Request *recv, *send;
+  elem_t *A;
+  double t;
+  MPI_Status status;
+
+  if (nseg > m) nseg = m;
+  if (nseg < 1) nseg = 1;
+  recv = (MPI_Request *) malloc(sizeof(MPI_Request)*nseg);
+  send = (MPI_Request *) malloc(sizeof(MPI_Request)*nseg);
+
+  for (stage=0; stage<q; stage++) {
+    if (verbose) {
+      printf("    stage %d\n", stage);
+      fflush(stdout);
+    }
+
+    /* All segments come from the left neighbour, so their receives
+       are posted first and matched in order */
+    root = (g->my_row+stage)%q;
+    A = (root == g->my_col) ? X_local : tmp;
+    t = MPI_Wtime();
+    if (root != g->my_col) {
+      for (s=0; s<nseg; s++) {
+	r0 = (int) ((long) m*s/nseg);
+	r1 = (int) ((long) m*(s+1)/nseg);
+	MPI_Irecv(A+(long) r0*k, (r1-r0)*k, MPI_ELEM,
+		  (g->my_col+q-1)%q, datatag, g->row_comm, &recv[s]);
+      }
+    }
+
+    nsend = 0;
+    for (s=0; s<nseg; s++) {
+      r0 = (int) ((long) m*s/nseg);
+      r1 = (int) ((long) m*(s+1)/nseg);
+      if (root != g->my_col) MPI_Wait(&recv[s], MPI_STATUS_IGNORE);
+      if (right != root)
+	MPI_Isend(A+(long) r0*k, (r1-r0)*k, MPI_ELEM, right,
+		  datatag, g->row_comm, &send[nsend++]);
+      t = stats_add(stage, T_BCAST, t, (s == 0) ? xbytes : 0.0);
+      local_gemm(r1-r0, n, k, A+(long) r0*k, k, Y_local, n,
+		 Z_local+(long) r0*n, n);
+      t = stats_add(stage, T_COMPUTE, t, 2.0*n*k*(double) (r1-r0));
+    }
+    MPI_Waitall(nsend, send, MPI_STATUSES_IGNORE);
+    t = stats_add(stage, T_BCAST, t, 0.0);
+
+    MPI_Sendrecv_replace(Y_local, k*n, MPI_ELEM, g->dest, datatag,
+			 g->source, datatag, g->col_comm, &status);
+    stats_add(stage, T_SHIFT, t, ybytes);
+  }
+
+  free(recv);
+  free(send);
+}
+
+/* The communication of Fox's algorithm is the same for every
+   multiplication of matrices of the same size, so in batch mode it is
+   set up once as persistent requests, which are started again in every
+   stage. Each process takes part in the broadcasts of the q stages,
+   with the roots and buffers fixed per stage, and in the shift of Y
+   between the two buffers Bbuf[0] and Bbuf[1]. */
+typedef struct {
+  int q, n;                     /* Nr of stages and elements in a block */
+  elem_t *X_local;              /* The own block of X */
+  elem_t *Abuf[2], *Bbuf[2];    /* Received blocks of X, blocks of Y */
+  MPI_Request *bcast;           /* Broadcast of X in each stage */
+  MPI_Request send[2], recv[2]; /* Shift of Bbuf[0] and Bbuf[1] */
+} fox_plan_t;
+
+/* The buffer the block of X is broadcast in, in the given stage */
+static elem_t *plan_xblock(fox_plan_t *plan, grid_t *g, int stage) {
+  int root = (g->my_row+stage)%g->q;
+  return((root == g->my_col) ? plan->X_local : plan->Abuf[stage%2]);
+}
+
+/* Sets up the persistent requests of Fox's algorithm for the blocks
+   X_local and Y_local of order N_local, which must stay at the same
+   addresses as long as the plan is used */
+void fox_plan_init(fox_plan_t *plan, grid_t *g, elem_t *X_local,
+		   elem_t *Y_local, int N_local) {
+  int stage, k;
+
+  plan->q = g->q;
+  plan->n = N_local*N_local;
+  plan->X_local = X_local;
+  plan->Abuf[0] = (elem_t *) malloc(sizeof(elem_t)*plan->n);
+  plan->Abuf[1] = (elem_t *) malloc(sizeof(elem_t)*plan->n);
+  plan->Bbuf[0] = Y_local;
+  plan->Bbuf[1] = (elem_t *) malloc(sizeof(elem_t)*plan->n);
+  plan->bcast = (MPI_Request *) malloc(sizeof(MPI_Request)*g->q);
+  for (stage=0; stage<g->q; stage++) {
+#ifdef HAVE_BCAST_INIT
+    MPI_Bcast_init(plan_xblock(plan, g, stage), plan->n, MPI_ELEM,
+		   (g->my_row+stage)%g->q, g->row_comm, MPI_INFO_NULL,
+		   &plan->bcast[stage]);
+#else
+    plan->bcast[stage] = MPI_REQUEST_NULL;
+#endif
+  }
+  for (k=0; k<2; k++) {
+    MPI_Send_init(plan->Bbuf[k], plan->n, MPI_ELEM, g->dest, datatag,
+		  g->col_comm, &plan->send[k]);
+    MPI_Recv_init(plan->Bbuf[k], plan->n, MPI_ELEM, g->source, datatag,
+		  g->col_comm, &plan->recv[k]);
+  }
+}
+
+/* Frees the requests and buffers of the plan */
+void fox_plan_free(fox_plan_t *plan) {
+  int stage, k;
+#ifdef HAVE_BCAST_INIT
+  for (stage=0; stage<plan->q; stage++) MPI_Request_free(&plan->bcast[stage]);
+#endif
+  for (k=0; k<2; k++) {
+    MPI_Request_free(&plan->send[k]);
+    MPI_Request_free(&plan->recv[k]);
+  }
+  free(plan->bcast);
+  free(plan->Abuf[0]);
+  free(plan->Abuf[1]);
+  free(plan->Bbuf[1]);
+}
+
+/* Starts the broadcast of the block of X for the given stage */
+static void plan_start_bcast(fox_plan_t *plan, grid_t *g, int stage) {
+#ifdef HAVE_BCAST_INIT
+  (void) g;
+  MPI_Start(&plan->bcast[stage]);
+#else
+  MPI_Ibcast(plan_xblock(plan, g, stage), plan->n, MPI_ELEM,
+	     (g->my_row+stage)%g->q, g->row_comm, &plan->bcast[stage]);
+#endif
+}
+
+/* Fox's algorithm with the persistent requests of plan, double
+   buffered as in fox_stages_pipelined: the broadcast and the shift for
+   the next stage run while the current blocks are multiplied.
+   X_local and Y_local are the blocks the plan was made for, and on
+   return Y_local holds the original block of Y again. */
+void fox_stages_persistent(fox_plan_t *plan, grid_t *g, acc_t *Z_local,
+			   int N_local, int verbose) {
+  const double bytes = sizeof(elem_t)*(double) plan->n;
+  int stage;
+  double t = MPI_Wtime();
+
+  plan_start_bcast(plan, g, 0);
+  MPI_Wait(&plan->bcast[0], MPI_STATUS_IGNORE);
+  stats_add(0, T_BCAST, t, bytes);
+
+  for (stage=0; stage<g->q; stage++) {
+    if (verbose) {
+      printf("    stage %d\n", stage);
+      fflush(stdout);
+    }
+
+    /* Start the broadcast for the next stage and the shift of Y */
+    if (stage+1 < g->q) plan_start_bcast(plan, g, stage+1);
+    MPI_Start(&plan->send[stage%2]);
+    MPI_Start(&plan->recv[(stage+1)%2]);
+
+    t = MPI_Wtime();
+    local_mult(plan_xblock(plan, g, stage), plan->Bbuf[stage%2], Z_local,
+	       N_local);
+    t = stats_add(stage, T_COMPUTE, t, 2.0*N_local*plan->n);
+
+    if (stage+1 < g->q) MPI_Wait(&plan->bcast[stage+1], MPI_STATUS_IGNORE);
+    MPI_Wait(&plan->send[stage%2], MPI_STATUS_IGNORE);
+    MPI_Wait(&plan->recv[(stage+1)%2], MPI_STATUS_IGNORE);
+    stats_add(stage, T_SHIFT, t, (stage+1 < g->q) ? 2*bytes : bytes);
+  }
+
+  /* After q shifts the original block is in Bbuf[q%2] */
+  if (g->q%2 != 0)
+    memcpy(plan->Bbuf[0], plan->Bbuf[1], sizeof(elem_t)*plan->n);
+}
+
+/* In the sparse mode the blocks are sent and multiplied in compressed
+   sparse row (CSR) format, unless they have more nonzeros than the
+   density threshold allows. A block of order n is kept in one buffer
+   so that it can be sent in one message, either dense as n*n elements
+   or as rowptr[n+1] and colidx[nnz], padded to 8 bytes, and val[nnz].
+   The number of nonzeros, or -1 for a dense block, is sent first. */
+typedef struct {
+  int n;                        /* Order of the block */
+  int nnz;                      /* Nr of nonzeros, -1 if stored dense */
+  char *buf;
+} sblock_t;
+
+/* Offset of the values in the buffer of a CSR block */
+static long csr_val_offset(int n, int nnz) {
+  return((sizeof(int)*(n+1L+nnz)+7)/8*8);
+}
+
+/* Size in bytes of a block of order n with nnz nonzeros, or dense */
+static long sblock_bytes(int n, int nnz) {
+  if (nnz < 0) return(sizeof(elem_t)*(long) n*n);
+  return(csr_val_offset(n, nnz)+sizeof(elem_t)*nnz);
+}
+
+static int *sb_rowptr(sblock_t *b) { return((int *) b->buf); }
+static int *sb_colidx(sblock_t *b) { return((int *) b->buf+b->n+1); }
+static elem_t *sb_val(sblock_t *b) {
+  return((elem_t *) (b->buf+csr_val_offset(b->n, b->nnz)));
+}
+
+/* Stores the dense block M of order n in b, in CSR format if it has at
+   most max_nnz nonzeros */
+static void sblock_set(sblock_t *b, elem_t *M, int n, int max_nnz) {
+  int *rowptr = (int *) b->buf;
+  /* The values are compressed after room for max_nnz column indexes,
+     and moved down when the real number of nonzeros is known */
+  elem_t *val = (elem_t *) (b->buf+csr_val_offset(n, max_nnz));
+  b->n = n;
+  b->nnz = matrix_csr_compress_t(n, n, M, n, max_nnz, rowptr, rowptr+n+1,
+				 val);
+  if (b->nnz >= 0) memmove(sb_val(b), val, sizeof(elem_t)*b->nnz);
+  else memcpy(b->buf, M, sizeof(elem_t)*n*n);
+}
+
+/* Z += A*B for blocks stored dense or sparse, with the kernel that
+   fits their formats */
+static void sparse_mult(sblock_t *A, sblock_t *B, acc_t *Z) {
+  int n = A->n;
+  if (A->nnz >= 0 && B->nnz >= 0)
+    matrixmult_csr_csr_t(n, sb_rowptr(A), sb_colidx(A), sb_val(A),
+			 sb_rowptr(B), sb_colidx(B), sb_val(B), Z, n);
+  else if (A->nnz >= 0)
+    matrixmult_csr_dense_t(n, n, sb_rowptr(A), sb_colidx(A), sb_val(A),
+			   (elem_t *) B->buf, n, Z, n);
+  else if (B->nnz >= 0)
+    matrixmult_dense_csr_t(n, n, (elem_t *) A->buf, n, sb_rowptr(B),
+			   sb_colidx(B), sb_val(B), Z, n);
+  else
+    local_mult((elem_t *) A->buf, (elem_t *) B->buf, Z, n);
+}
+
+/* Nr of flops done by sparse_mult(A, B, Z). With a sparse A each of
+   its nonzeros is multiplied with a row of B, and with a dense A each
+   element with a row of a sparse B. */
+static double sparse_flops(sblock_t *A, sblock_t *B) {
+  int n = A->n, i, p;
+  double f = 0.0;
+  if (A->nnz >= 0 && B->nnz >= 0) {
+    for (p=0; p<A->nnz; p++) {
+      i = sb_colidx(A)[p];
+      f += sb_rowptr(B)[i+1]-sb_rowptr(B)[i];
+    }
+    return(2.0*f);
+  }
+  if (A->nnz >= 0) return(2.0*A->nnz*n);
+  if (B->nnz >= 0) return(2.0*B->nnz*n);
+  return(2.0*n*n*n);
+}
+
+/* Fox's algorithm with sparse blocks. The blocks of X and Y are stored
+   in CSR format if their density is at most threshold, and are then
+   broadcast and shifted compressed, so that both the messages and the
+   multiplications scale with the number of nonzeros. Denser blocks are
+   sent and multiplied as in fox_stages. X_local and Y_local are left
+   as they were. Process 0 reports how many of the blocks were sparse
+   and the message volume compared to dense blocks */
+void fox_stages_sparse(grid_t *g, elem_t *X_local, elem_t *Y_local,
+		       acc_t *Z_local, int N_local, double threshold,
+		       int verbose) {
+  int max_nnz = (int) (threshold*N_local*N_local);
+  long size = sblock_bytes(N_local, max_nnz);
+  int stage, root, k;
+  sblock_t Xown, Arecv, Yb[2], *A, *B_cur, *B_next;
+  double count[4], total[4];  /* Sparse and all blocks, bytes sent, dense */
+  double t;
+  MPI_Status status;
+
+  if (size < sblock_bytes(N_local, -1)) size = sblock_bytes(N_local, -1);
+  Xown.buf = (char *) malloc(size);
+  Arecv.buf = (char *) malloc(size);
+  Yb[0].buf = (char *) malloc(size);
+  Yb[1].buf = (char *) malloc(size);
+  Arecv.n = Yb[1].n = N_local;
+  sblock_set(&Xown, X_local, N_local, max_nnz);
+  sblock_set(&Yb[0], Y_local, N_local, max_nnz);
+  for (k=0; k<4; k++) count[k] = 0.0;
+
+  for (stage=0; stage<g->q; stage++) {
+    B_cur = &Yb[stage%2];
+    B_next = &Yb[(stage+1)%2];
+    if (verbose) {
+      printf("    stage %d\n", stage);
+      fflush(stdout);
+    }
+
+    /* Broadcast the size and then the block of X along the row */
+    root = (g->my_row+stage)%g->q;
+    A = (root == g->my_col) ? &Xown : &Arecv;
+    t = MPI_Wtime();
+    MPI_Bcast(&A->nnz, 1, MPI_INT, root, g->row_comm);
+    MPI_Bcast(A->buf, sblock_bytes(N_local, A->nnz), MPI_BYTE, root,
+	      g->row_comm);
+    t = stats_add(stage, T_BCAST, t, sblock_bytes(N_local, A->nnz));
+    if (root == g->my_col) {
+      count[0] += (A->nnz >= 0);
+      count[1] += 1;
+      count[2] += sblock_bytes(N_local, A->nnz);
+      count[3] += sblock_bytes(N_local, -1);
+    }
+
+    sparse_mult(A, B_cur, Z_local);
+    t = stats_add(stage, T_COMPUTE, t,
+		  record_stats ? sparse_flops(A, B_cur) : 0.0);
+
+    /* Shift the block of Y one step up, first its size */
+    MPI_Sendrecv(&B_cur->nnz, 1, MPI_INT, g->dest, datatag, &B_next->nnz, 1,
+		 MPI_INT, g->source, datatag, g->col_comm, &status);
+    MPI_Sendrecv(B_cur->buf, sblock_bytes(N_local, B_cur->nnz), MPI_BYTE,
+		 g->dest, datatag, B_next->buf,
+		 sblock_bytes(N_local, B_next->nnz), MPI_BYTE, g->source,
+		 datatag, g->col_comm, &status);
+    stats_add(stage, T_SHIFT, t, sblock_bytes(N_local, B_cur->nnz));
+    count[0] += (B_cur->nnz >= 0);
+    count[1] += 1;
+    count[2] += sblock_bytes(N_local, B_cur->nnz);
+    count[3] += sblock_bytes(N_local, -1);
+  }
+
+  MPI_Reduce(count, total, 4, MPI_DOUBLE, MPI_SUM, 0, g->grid_comm);
+  if (g->my_row == 0 && g->my_col == 0 && g->my_layer == 0) {
+    printf("    %.0f of %.0f blocks sent sparse, message volume %.1f%% of dense\n",
+	   total[0], total[1], 100.0*total[2]/total[3]);
+    fflush(stdout);
+  }
+
+  free(Xown.buf);
+  free(Arecv.buf);
+  free(Yb[0].buf);
+  free(Yb[1].buf);
+}
+
+/* Fox's algorithm with the blocks compressed by matrix_compress before
+   they are broadcast or shifted, for slow networks and matrices of low
+   entropy. Every block of Y is compressed once and stays compressed as
+   it is shifted, so only the decompression is repeated in every stage.
+   The time spent compressing and decompressing is counted in the time
+   of the broadcasts and shifts in the stage statistics, and the bytes
+   are those sent. Process 0 reports the compression ratio and the time
+   of the coding over all stages, and in verbose mode for every stage */
+void fox_stages_compressed(grid_t *g, elem_t *X_local, elem_t *Y_local,
+			   acc_t *Z_local, elem_t *tmp, int N_local,
+			   int verbose) {
+  const int q = g->q, size = sizeof(elem_t);
+  const long n = (long) N_local*N_local;
+  const long cap = matrix_compress_bound(n, size);
+  unsigned char *xbuf, *ybuf[2];
+  long len, ylen;
+  int stage, bcast_root, cur = 0, count;
+  double t, t0, *info, *sum, *coding, *max_coding;
+  elem_t *A;
+  MPI_Status status;
+
+  xbuf = (unsigned char *) malloc(cap);
+  ybuf[0] = (unsigned char *) malloc(cap);
+  ybuf[1] = (unsigned char *) malloc(cap);
+  /* Per stage the bytes of the broadcast and the shift before and after
+     compression, counted by the sender, and the time of the coding */
+  info = (double *) calloc(4*q, sizeof(double));
+  sum = (double *) malloc(sizeof(double)*4*q);
+  coding = (double *) calloc(q, sizeof(double));
+  max_coding = (double *) malloc(sizeof(double)*q);
+
+  t0 = MPI_Wtime();
+  ylen = matrix_compress(Y_local, n, size, ybuf[0]);
+  coding[0] += MPI_Wtime()-t0;
+
+  for (stage=0; stage<q; stage++) {
+    if (verbose) {
+      printf("    stage %d\n", stage);
+      fflush(stdout);
+    }
+
+    /* The process bcast_root compresses its block of X and broadcasts
+       first the size and then the compressed block */
+    bcast_root = (g->my_row+stage)%q;
+    t = MPI_Wtime();
+    if (bcast_root == g->my_col) {
+      len = matrix_compress(X_local, n, size, xbuf);
+      coding[stage] += MPI_Wtime()-t;
+      info[4*stage] = size*(double) n;
+      info[4*stage+1] = len;
+    }
+    MPI_Bcast(&len, 1, MPI_LONG, bcast_root, g->row_comm);
+    MPI_Bcast(xbuf, (int) len, MPI_BYTE, bcast_root, g->row_comm);
+    if (bcast_root == g->my_col) {
+      A = X_local;
+    } else {
+      t0 = MPI_Wtime();
+      matrix_decompress(xbuf, n, size, tmp);
+      coding[stage] += MPI_Wtime()-t0;
+      A = tmp;
+    }
+    t = stats_add(stage, T_BCAST, t, len);
+
+    local_mult(A, Y_local, Z_local, N_local);
+    t = stats_add(stage, T_COMPUTE, t, 2.0*N_local*n);
+
+    /* Shift the compressed block of Y up in the column */
+    MPI_Sendrecv(ybuf[cur], (int) ylen, MPI_BYTE, g->dest, datatag,
+		 ybuf[1-cur], (int) cap, MPI_BYTE, g->source, datatag,
+		 g->col_comm, &status);
+    info[4*stage+2] = size*(double) n;
+    info[4*stage+3] = ylen;
+    MPI_Get_count(&status, MPI_BYTE, &count);
+    ylen = count;
+    cur = 1-cur;
+    t0 = MPI_Wtime();
+    matrix_decompress(ybuf[cur], n, size, Y_local);
+    coding[stage] += MPI_Wtime()-t0;
+    stats_add(stage, T_SHIFT, t, info[4*stage+3]);
+  }
+
+  MPI_Reduce(info, sum, 4*q, MPI_DOUBLE, MPI_SUM, 0, g->grid_comm);
+  MPI_Reduce(coding, max_coding, q, MPI_DOUBLE, MPI_MAX, 0, g->grid_comm);
+  if (g->my_row == 0 && g->my_col == 0 && g->my_layer == 0) {
+    double raw = 0.0, packed = 0.0, total = 0.0;
+    for (stage=0; stage<q; stage++) {
+      if (verbose)
+	printf("    stage %d: broadcast ratio %.2f, shift ratio %.2f, coding "
+	       "%.4f s\n", stage, sum[4*stage]/sum[4*stage+1],
+	       sum[4*stage+2]/sum[4*stage+3], max_coding[stage]);
+      raw += sum[4*stage]+sum[4*stage+2];
+      packed += sum[4*stage+1]+sum[4*stage+3];
+      total += max_coding[stage];
+    }
+    printf("    blocks compressed to %.1f%% of their size, ratio %.2f, "
+	   "%.3f s coding\n", 100.0*packed/raw, raw/packed, total);
+    fflush(stdout);
+  }
+
+  free(xbuf);
+  free(ybuf[0]);
+  free(ybuf[1]);
+  free(info);
+  free(sum);
+  free(coding);
+  free(max_coding);
+}
+
+
+/* The shared memory mode. The processes of the grid that share memory,
+   on one node or in groups of a given size within a node, allocate
+   their blocks of X and Y in a shared window. In stage s of Fox's
+   algorithm process (i,j) needs the original blocks X(i,k) and Y(k,j),
+   where k = (i+s) mod q, so blocks owned by processes in the same
+   group are multiplied in place, without the broadcast and the shift.
+   Only blocks from other nodes are sent: X is broadcast from its owner
+   to one process in each other node of the row, which receives it in
+   its part of the window for the others on the node to read, and Y is
+   sent straight from its owner to the process that needs it. */
+typedef struct {
+  MPI_Comm node_comm;           /* Processes of the grid sharing memory */
+  MPI_Win win;                  /* Window with the blocks of all of them */
+  int n;                        /* Nr of elements in a block */
+  elem_t *X, *Y;                /* Own blocks of X and Y in the window */
+  elem_t **seg;                 /* Parts of the window of the node */
+  elem_t *Brecv;                /* Block of Y received from another node */
+  int *row_node, *col_node;     /* Node ranks of the processes in the row
+				   and column, MPI_UNDEFINED if elsewhere */
+  int *leader;                  /* Per stage, the process in the row that
+				   receives X for this node, -1 if X is
+				   on the node */
+  MPI_Comm *bcast_comm;         /* Per stage, the owner of X and the
+				   leaders of the other nodes */
+} shm_t;
+
+/* Sets up the shared memory mode for blocks of order N_local. With
+   group > 0 the processes on a node are split further into groups of
+   group processes, for instance one per socket. Called by all
+   processes of the grid */
+void shm_init(shm_t *shm, grid_t *g, int N_local, int group) {
+  const int q = g->q;
+  MPI_Comm node;
+  MPI_Group row_group, col_group, node_group;
+  MPI_Aint size;
+  int node_size, node_rank, node_id, world_rank, disp_unit;
+  int *row_ids, *ranks, i, s, k, c, members;
+  elem_t *base;
+
+  /* Find the processes sharing memory, and give each node the world
+     rank of its first process as an identifier */
+  MPI_Comm_split_type(g->grid_comm, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL,
+		      &node);
+  if (group > 0) {
+    MPI_Comm_rank(node, &node_rank);
+    MPI_Comm_split(node, node_rank/group, 0, &shm->node_comm);
+    MPI_Comm_free(&node);
+  } else {
+    shm->node_comm = node;
+  }
+  MPI_Comm_size(shm->node_comm, &node_size);
+  MPI_Comm_rank(MPI_COMM_WORLD, &world_rank);
+  node_id = world_rank;
+  MPI_Bcast(&node_id, 1, MPI_INT, 0, shm->node_comm);
+
+  /* The window holds X, Y and two buffers for X from other nodes */
+  shm->n = N_local*N_local;
+  MPI_Win_allocate_shared(4*sizeof(elem_t)*shm->n, sizeof(elem_t),
+			  MPI_INFO_NULL, shm->node_comm, &base, &shm->win);
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, shm->win);
+  shm->X = base;
+  shm->Y = base+shm->n;
+  shm->seg = (elem_t **) malloc(sizeof(elem_t *)*node_size);
+  for (i=0; i<node_size; i++)
+    MPI_Win_shared_query(shm->win, i, &size, &disp_unit, &shm->seg[i]);
+  shm->Brecv = (elem_t *) malloc(sizeof(elem_t)*shm->n);
+
+  /* Where the processes of the row and the column are */
+  ranks = (int *) malloc(sizeof(int)*q);
+  for (i=0; i<q; i++) ranks[i] = i;
+  shm->row_node = (int *) malloc(sizeof(int)*q);
+  shm->col_node = (int *) malloc(sizeof(int)*q);
+  MPI_Comm_group(g->row_comm, &row_group);
+  MPI_Comm_group(g->col_comm, &col_group);
+  MPI_Comm_group(shm->node_comm, &node_group);
+  MPI_Group_translate_ranks(row_group, q, ranks, node_group, shm->row_node);
+  MPI_Group_translate_ranks(col_group, q, ranks, node_group, shm->col_node);
+  MPI_Group_free(&row_group);
+  MPI_Group_free(&col_group);
+  MPI_Group_free(&node_group);
+  row_ids = (int *) malloc(sizeof(int)*q);
+  MPI_Allgather(&node_id, 1, MPI_INT, row_ids, 1, MPI_INT, g->row_comm);
+
+  /* For every stage, the process of each node in the row that receives
+     X when its owner is elsewhere is the first one on the node. They
+     get a communicator with the owner, as its process 0 */
+  shm->leader = (int *) malloc(sizeof(int)*q);
+  shm->bcast_comm = (MPI_Comm *) malloc(sizeof(MPI_Comm)*q);
+  for (s=0; s<q; s++) {
+    k = (g->my_row+s)%q;
+    shm->leader[s] = -1;
+    if (shm->row_node[k] == MPI_UNDEFINED) {
+      for (c=0; row_ids[c] != node_id; c++);
+      shm->leader[s] = c;
+    }
+    members = 1;
+    for (c=0; c<q; c++) {
+      for (i=0; i<c && row_ids[i] != row_ids[c]; i++);
+      if (i == c && row_ids[c] != row_ids[k]) members++;
+    }
+    MPI_Comm_split(g->row_comm, (members > 1 && (g->my_col == k ||
+						 shm->leader[s] == g->my_col))
+		   ? 0 : MPI_UNDEFINED, (g->my_col == k) ? -1 : g->my_col,
+		   &shm->bcast_comm[s]);
+  }
+  free(ranks);
+  free(row_ids);
+}
+
+/* Frees the window and the communicators of the shared memory mode */
+void shm_free(shm_t *shm, grid_t *g) {
+  int s;
+  for (s=0; s<g->q; s++) {
+    if (shm->bcast_comm[s] != MPI_COMM_NULL) MPI_Comm_free(&shm->bcast_comm[s]);
+  }
+  MPI_Win_unlock_all(shm->win);
+  MPI_Win_free(&shm->win);
+  MPI_Comm_free(&shm->node_comm);
+  free(shm->seg);
+  free(shm->Brecv);
+  free(shm->row_node);
+  free(shm->col_node);
+  free(shm->leader);
+  free(shm->bcast_comm);
+}
+
+/* Fox's algorithm in the shared memory mode, with X_local and Y_local
+   in the window set up by shm_init. Blocks on the same node are read
+   in place and the others are sent, see shm_t. Every stage ends the
+   communication with a barrier on the node, after which the received
+   blocks can be read by the other processes there. The blocks from
+   other nodes are received in alternate buffers in even and odd
+   stages, so that they aren't overwritten while they are still used.
+   Process 0 reports how many of the blocks were read in place. */
+void fox_stages_shm(shm_t *shm, grid_t *g, acc_t *Z_local, int N_local,
+		    int verbose) {
+  const int q = g->q;
+  const double bytes = sizeof(elem_t)*(double) shm->n;
+  int stage, k, ydst, nreq, root;
+  elem_t *A, *B;
+  double count[2], total[2], t;   /* Blocks read in place and all blocks */
+  MPI_Request req[2];
+
+  count[0] = count[1] = 0.0;
+  for (stage=0; stage<q; stage++) {
+    if (verbose) {
+      printf("    stage %d\n", stage);
+      fflush(stdout);
+    }
+    k = (g->my_row+stage)%q;
+    ydst = (g->my_row-stage+q)%q;
+
+    /* Broadcast X to the nodes that don't have it */
+    t = MPI_Wtime();
+    if (shm->bcast_comm[stage] != MPI_COMM_NULL) {
+      MPI_Comm_rank(shm->bcast_comm[stage], &root);
+      MPI_Bcast((root == 0) ? shm->X : shm->X+(2+stage%2)*shm->n, shm->n,
+		MPI_ELEM, 0, shm->bcast_comm[stage]);
+    }
+    t = stats_add(stage, T_BCAST, t,
+		  (shm->bcast_comm[stage] != MPI_COMM_NULL) ? bytes : 0.0);
+
+    /* Send Y to the process that needs it, if it is on another node */
+    nreq = 0;
+    if (shm->col_node[k] == MPI_UNDEFINED)
+      MPI_Irecv(shm->Brecv, shm->n, MPI_ELEM, k, datatag, g->col_comm,
+		&req[nreq++]);
+    if (shm->col_node[ydst] == MPI_UNDEFINED)
+      MPI_Isend(shm->Y, shm->n, MPI_ELEM, ydst, datatag, g->col_comm,
+		&req[nreq++]);
+    MPI_Waitall(nreq, req, MPI_STATUSES_IGNORE);
+
+    /* Make the blocks received on the node visible to all */
+    MPI_Win_sync(shm->win);
+    MPI_Barrier(shm->node_comm);
+    MPI_Win_sync(shm->win);
+    t = stats_add(stage, T_SHIFT, t, (shm->col_node[k] == MPI_UNDEFINED) ?
+		  bytes : 0.0);
+
+    if (shm->leader[stage] < 0)
+      A = shm->seg[shm->row_node[k]];
+    else
+      A = shm->seg[shm->row_node[shm->leader[stage]]]+(2+stage%2)*shm->n;
+    if (shm->col_node[k] != MPI_UNDEFINED)
+      B = shm->seg[shm->col_node[k]]+shm->n;
+    else
+      B = shm->Brecv;
+    count[0] += (shm->leader[stage] < 0)+(shm->col_node[k] != MPI_UNDEFINED);
+    count[1] += 2;
+
+    local_mult(A, B, Z_local, N_local);
+    stats_add(stage, T_COMPUTE, t, 2.0*N_local*shm->n);
+  }
+
+  MPI_Reduce(count, total, 2, MPI_DOUBLE, MPI_SUM, 0, g->grid_comm);
+  if (g->my_row == 0 && g->my_col == 0 && g->my_layer == 0) {
+    printf("    %.0f of %.0f blocks read in shared memory\n", total[0],
+	   total[1]);
+    fflush(stdout);
+  }
+}
+
+/* The SUMMA algorithm. X, Y and Z are distributed over a p*q grid as
+   described at grid_t, with blocks of uneven size if p or q doesn't
+   divide the sizes, and may be rectangular.
+   The inner dimension is traversed in panels that lie within one
+   process column of X and one process row of Y. For each panel, the
+   owners broadcast their columns of X along the rows and their rows of
+   Y along the columns, and all processes add the product of the two
+   panels to their block of Z. The width of the panels is the block
+   size given with -b, or SUMMA_PANEL. */
+void summa(grid_t *g, elem_t *X_local, elem_t *Y_local, acc_t *Z_local,
+	   int verbose) {
+  const int m = g->m_local, n = g->n_local, kx = g->x.n;
+  int kb = (blocksize > 0) ? blocksize : SUMMA_PANEL;
+  int k0, w, i, j;
+  int xcol, yrow;               /* Owners of the panels of X and Y */
+  elem_t *Xpanel, *Ypanel, *Y_k;
+  int panel = 0;
+  double t;
+
+  Xpanel = (elem_t *) malloc(sizeof(elem_t)*m*kb);
+  Ypanel = (elem_t *) malloc(sizeof(elem_t)*kb*n);
+
+  for (k0=0; k0<g->K; k0+=w) {
+    /* Find the owners and the width of the next panel */
+    xcol = block_owner(k0, g->q, g->K);
+    yrow = block_owner(k0, g->p, g->K);
+    w = min(kb, min(block_low(xcol+1, g->q, g->K),
+		    block_low(yrow+1, g->p, g->K)) - k0);
+    if (verbose) {
+      printf("    panel %d..%d\n", k0, k0+w-1);
+      fflush(stdout);
+    }
+
+    /* Copy the columns of the panel of X to a contiguous buffer */
+    t = MPI_Wtime();
+    if (g->my_col == xcol) {
+      for (i=0; i<m; i++) {
+	for (j=0; j<w; j++) Xpanel[i*w+j] = X_local[i*kx+(k0-g->x.col0)+j];
+      }
+    }
+    MPI_Bcast(Xpanel, m*w, MPI_ELEM, xcol, g->row_comm);
+
+    /* The rows of the panel of Y are already contiguous */
+    Y_k = (g->my_row == yrow) ? Y_local+(k0-g->y.row0)*n : Ypanel;
+    MPI_Bcast(Y_k, w*n, MPI_ELEM, yrow, g->col_comm);
+    t = stats_add(panel, T_BCAST, t, sizeof(elem_t)*((double) m*w+(double) w*n));
+
+    local_gemm(m, n, w, Xpanel, w, Y_k, n, Z_local, n);
+    stats_add(panel++, T_COMPUTE, t, 2.0*m*n*w);
+  }
+
+  free(Xpanel);
+  free(Ypanel);
+}
+
+
+/* Cannon's algorithm. The blocks of X are first skewed my_row steps to
+   the left along the rows, and the blocks of Y my_col steps up along
+   the columns, so that process (i,j) holds X(i,i+j) and Y(i+j,j). In
+   each of the q stages the blocks are multiplied and then shifted one
+   step, X to the left and Y up, so after the skew only nearest
+   neighbour communication is needed. At the end the blocks are moved
+   back to where they started. */
+void cannon(grid_t *g, elem_t *X_local, elem_t *Y_local, acc_t *Z_local,
+	    int N_local, int verbose) {
+  const int n = N_local*N_local;
+  const double bytes = sizeof(elem_t)*(double) n;
+  int stage, source, dest;
+  int left, right, up, down;
+  double t = MPI_Wtime();
+  MPI_Status status;
+
+  /* Initial skew, counted as a shift of the first stage */
+  MPI_Cart_shift(g->grid_comm, 1, -g->my_row, &source, &dest);
+  MPI_Sendrecv_replace(X_local, n, MPI_ELEM, dest, datatag, source, datatag,
+		       g->grid_comm, &status);
+  MPI_Cart_shift(g->grid_comm, 0, -g->my_col, &source, &dest);
+  MPI_Sendrecv_replace(Y_local, n, MPI_ELEM, dest, datatag, source, datatag,
+		       g->grid_comm, &status);
+
+  /* Neighbours for the shifts in each stage */
+  MPI_Cart_shift(g->grid_comm, 1, -1, &right, &left);
+  MPI_Cart_shift(g->grid_comm, 0, -1, &down, &up);
+  t = stats_add(0, T_SHIFT, t, 2*bytes);
+
+  for (stage=0; stage<g->q; stage++) {
+    if (verbose) {
+      printf("    stage %d\n", stage);
+      fflush(stdout);
+    }
+    local_mult(X_local, Y_local, Z_local, N_local);
+    t = stats_add(stage, T_COMPUTE, t, 2.0*N_local*n);
+    /* The blocks aren't needed after the last stage */
+    if (stage < g->q-1) {
+      MPI_Sendrecv_replace(X_local, n, MPI_ELEM, left, datatag, right,
+			   datatag, g->grid_comm, &status);
+      MPI_Sendrecv_replace(Y_local, n, MPI_ELEM, up, datatag, down,
+			   datatag, g->grid_comm, &status);
+      t = stats_add(stage, T_SHIFT, t, 2*bytes);
+    }
+  }
+
+  /* Process (i,j) now holds X(i,i+j-1) and Y(i+j-1,j), move them back */
+  MPI_Cart_shift(g->grid_comm, 1, g->my_row-1, &source, &dest);
+  MPI_Sendrecv_replace(X_local, n, MPI_ELEM, dest, datatag, source, datatag,
+		       g->grid_comm, &status);
+  MPI_Cart_shift(g->grid_comm, 0, g->my_col-1, &source, &dest);
+  MPI_Sendrecv_replace(Y_local, n, MPI_ELEM, dest, datatag, source, datatag,
+		       g->grid_comm, &status);
+  stats_add(g->q-1, T_SHIFT, t, 2*bytes);
+}
+
+
+/* The 2.5D algorithm on a q*q*c grid. The blocks of X and Y are
+   broadcast from layer 0 to all layers, and layer k does the q/c stages
+   k*q/c, ..., (k+1)*q/c-1 of Cannon's algorithm, starting with a skew
+   that includes the stages done by the layers below it. The partial
+   results are summed into Z_local in layer 0. Each process moves
+   O(q/c) blocks instead of O(q), at the cost of c times more memory.
+   Z_local should be zero in all layers when called. */
+void mult_2_5d(grid_t *g, elem_t *X_local, elem_t *Y_local, acc_t *Z_local,
+	       int N_local, int verbose) {
+  const int n = N_local*N_local;
+  const int steps = g->q/g->c;              /* Stages per layer */
+  const int offset = g->my_layer*steps;     /* First stage of the layer */
+  const double bytes = sizeof(elem_t)*(double) n;
+  int stage, source, dest;
+  int left, right, up, down;
+  double t = MPI_Wtime();
+  MPI_Status status;
+
+  /* Replicate the blocks on all layers */
+  MPI_Bcast(X_local, n, MPI_ELEM, 0, g->depth_comm);
+  MPI_Bcast(Y_local, n, MPI_ELEM, 0, g->depth_comm);
+  t = stats_add(offset, T_BCAST, t, 2*bytes);
+
+  /* Skew the blocks to the first stage of this layer */
+  MPI_Cart_shift(g->grid_comm, 1, -(g->my_row+offset), &source, &dest);
+  MPI_Sendrecv_replace(X_local, n, MPI_ELEM, dest, datatag, source, datatag,
+		       g->grid_comm, &status);
+  MPI_Cart_shift(g->grid_comm, 0, -(g->my_col+offset), &source, &dest);
+  MPI_Sendrecv_replace(Y_local, n, MPI_ELEM, dest, datatag, source, datatag,
+		       g->grid_comm, &status);
+
+  MPI_Cart_shift(g->grid_comm, 1, -1, &right, &left);
+  MPI_Cart_shift(g->grid_comm, 0, -1, &down, &up);
+  t = stats_add(offset, T_SHIFT, t, 2*bytes);
+
+  for (stage=0; stage<steps; stage++) {
+    if (verbose) {
+      printf("    stage %d\n", offset+stage);
+      fflush(stdout);
+    }
+    local_mult(X_local, Y_local, Z_local, N_local);
+    t = stats_add(offset+stage, T_COMPUTE, t, 2.0*N_local*n);
+    if (stage < steps-1) {
+      MPI_Sendrecv_replace(X_local, n, MPI_ELEM, left, datatag, right,
+			   datatag, g->grid_comm, &status);
+      MPI_Sendrecv_replace(Y_local, n, MPI_ELEM, up, datatag, down,
+			   datatag, g->grid_comm, &status);
+      t = stats_add(offset+stage, T_SHIFT, t, 2*bytes);
+    }
+  }
+
+  /* Sum the contributions of all layers in layer 0 */
+  MPI_Reduce((g->my_layer == 0) ? MPI_IN_PLACE : Z_local, Z_local, n,
+	     MPI_ACC, MPI_SUM, 0, g->depth_comm);
+  t = stats_add(offset+steps-1, T_BCAST, t, sizeof(acc_t)*(double) n);
+
+  /* Move the blocks in layer 0 back to where they started */
+  if (g->my_layer == 0) {
+    MPI_Cart_shift(g->grid_comm, 1, g->my_row+steps-1, &source, &dest);
+    MPI_Sendrecv_replace(X_local, n, MPI_ELEM, dest, datatag, source,
+			 datatag, g->grid_comm, &status);
+    MPI_Cart_shift(g->grid_comm, 0, g->my_col+steps-1, &source, &dest);
+    MPI_Sendrecv_replace(Y_local, n, MPI_ELEM, dest, datatag, source,
+			 datatag, g->grid_comm, &status);
+    stats_add(offset+steps-1, T_SHIFT, t, 2*bytes);
+  }
+}
+
+
+/* Gathers the stage timings of all processes in process 0, which
+   appends them to the file fn together with a summary of the run:
+   the speed in GFLOP/s over the time wall of the whole multiplication,
+   counting the 2*N^3 flops of a dense product, the bandwidth of the
+   communication and the load imbalance of the local multiplications.
+   Files ending in .json get one JSON object per run and line, other
+   files one line of CSV per process and stage, with a header if the
+   file is new. Stages where a process did nothing, as the stages of
+   other layers in the 2.5D algorithm, are left out. The benchmark
+   script foxbench.sh, run with make bench, sweeps sizes and grids with
+   this. Called by all processes */
+void write_stats(grid_t *g, char *fn, const char *alg, double wall) {
+  int nproc, id, i, k, r, len, *counts, *displs;
+  double *mine, *all = NULL, *d;
+  double comp, comp_max = 0.0, comp_sum = 0.0, flops = 0.0;
+  double comm_time = 0.0, comm_bytes = 0.0;
+  int active = 0, json;
+  FILE *fp;
+
+  MPI_Comm_size(MPI_COMM_WORLD, &nproc);
+  MPI_Comm_rank(MPI_COMM_WORLD, &id);
+
+  /* The run takes as long as the slowest process */
+  MPI_Reduce((id == 0) ? MPI_IN_PLACE : &wall, &wall, 1, MPI_DOUBLE, MPI_MAX,
+	     0, MPI_COMM_WORLD);
+
+  /* Own record: row, column, layer, nr of stages, times and amounts */
+  len = 4+2*NR_TIMERS*stats.stages;
+  mine = (double *) malloc(sizeof(double)*len);
+  mine[0] = g->my_row; mine[1] = g->my_col; mine[2] = g->my_layer;
+  mine[3] = stats.stages;
+  for (i=0; i<NR_TIMERS*stats.stages; i++) {
+    mine[4+i] = stats.time[i];
+    mine[4+NR_TIMERS*stats.stages+i] = stats.amount[i];
+  }
+  counts = (int *) malloc(sizeof(int)*nproc);
+  displs = (int *) malloc(sizeof(int)*nproc);
+  MPI_Gather(&len, 1, MPI_INT, counts, 1, MPI_INT, 0, MPI_COMM_WORLD);
+  if (id == 0) {
+    for (r=0, k=0; r<nproc; r++) {
+      displs[r] = k;
+      k += counts[r];
+    }
+    all = (double *) malloc(sizeof(double)*k);
+  }
+  MPI_Gatherv(mine, len, MPI_DOUBLE, all, counts, displs, MPI_DOUBLE, 0,
+	      MPI_COMM_WORLD);
+  free(mine);
+  if (id != 0) {
+    free(counts);
+    free(displs);
+    return;
+  }
+
+  /* Summary over the processes that took part */
+  for (r=0; r<nproc; r++) {
+    int st;
+    d = all+displs[r];
+    st = (int) d[3];
+    if (st == 0) continue;
+    comp = 0.0;
+    for (k=0; k<st; k++) {
+      comp += d[4+k*NR_TIMERS+T_COMPUTE];
+      flops += d[4+NR_TIMERS*st+k*NR_TIMERS+T_COMPUTE];
+      for (i=T_BCAST; i<=T_SHIFT; i++) {
+	comm_time += d[4+k*NR_TIMERS+i];
+	comm_bytes += d[4+NR_TIMERS*st+k*NR_TIMERS+i];
+      }
+    }
+    comp_max = fmax(comp_max, comp);
+    comp_sum += comp;
+    active++;
+  }
+  printf("    %.2f GFLOP/s, %.2f GB/s in communication, local multiplication "
+	 "%.3f s max, %.3f s mean\n", 2.0*g->M*g->K*(double) g->N/wall*1e-9,
+	 (comm_time > 0.0) ? comm_bytes/comm_time*1e-9 : 0.0, comp_max,
+	 (active > 0) ? comp_sum/active : 0.0);
+  fflush(stdout);
+
+  len = strlen(fn);
+  json = (len > 5 && strcmp(fn+len-5, ".json") == 0);
+  if ((fp=fopen(fn, "a")) == NULL) {
+    printf("Couldn't open file %s\n", fn);
+    fflush(stdout);
+  } else if (json) {
+    fprintf(fp, "{\"algorithm\": \"%s\", \"type\": \"%s\", \"N\": %d, "
+	    "\"p\": %d, \"q\": %d, \"c\": %d, \"nproc\": %d, "
+	    "\"threads\": %d, \"time\": %.6f, \"gflops\": %.3f, "
+	    "\"kernel_gflops\": %.3f, \"bandwidth_GBps\": %.3f, "
+	    "\"compute_max\": %.6f, \"compute_mean\": %.6f, \"ranks\": [",
+	    alg, ELEM_NAME, g->N, g->p, g->q, g->c, nproc, nthreads, wall,
+	    2.0*g->M*g->K*(double) g->N/wall*1e-9,
+	    (comp_sum > 0.0) ? flops/comp_sum*1e-9 : 0.0,
+	    (comm_time > 0.0) ? comm_bytes/comm_time*1e-9 : 0.0, comp_max,
+	    (active > 0) ? comp_sum/active : 0.0);
+    for (r=0; r<nproc; r++) {
+      int st;
+      d = all+displs[r];
+      st = (int) d[3];
+      fprintf(fp, "%s{\"rank\": %d, \"row\": %.0f, \"col\": %.0f, "
+	      "\"layer\": %.0f, \"stages\": [", (r > 0) ? ", " : "", r,
+	      d[0], d[1], d[2]);
+      for (k=0, i=0; k<st; k++) {
+	double *t = d+4+k*NR_TIMERS, *a = d+4+NR_TIMERS*st+k*NR_TIMERS;
+	if (t[T_BCAST]+t[T_SHIFT]+t[T_COMPUTE] == 0.0) continue;
+	fprintf(fp, "%s{\"stage\": %d, \"bcast\": %.6g, \"shift\": %.6g, "
+		"\"compute\": %.6g, \"bcast_bytes\": %.0f, "
+		"\"shift_bytes\": %.0f, \"flops\": %.0f}", (i++ > 0) ? ", " : "",
+		k, t[T_BCAST], t[T_SHIFT], t[T_COMPUTE], a[T_BCAST], a[T_SHIFT],
+		a[T_COMPUTE]);
+      }
+      fprintf(fp, "]}");
+    }
+    fprintf(fp, "]}\n");
+    fclose(fp);
+  } else {
+    fseek(fp, 0, SEEK_END);
+    if (ftell(fp) == 0)
+      fprintf(fp, "algorithm,type,N,p,q,c,nproc,threads,time,rank,row,col,"
+	      "layer,stage,bcast_s,shift_s,compute_s,bcast_bytes,shift_bytes,"
+	      "flops,gflops,bcast_GBps,shift_GBps\n");
+    for (r=0; r<nproc; r++) {
+      int st;
+      d = all+displs[r];
+      st = (int) d[3];
+      for (k=0; k<st; k++) {
+	double *t = d+4+k*NR_TIMERS, *a = d+4+NR_TIMERS*st+k*NR_TIMERS;
+	if (t[T_BCAST]+t[T_SHIFT]+t[T_COMPUTE] == 0.0) continue;
+	fprintf(fp, "%s,%s,%d,%d,%d,%d,%d,%d,%.6f,%d,%.0f,%.0f,%.0f,%d,"
+		"%.6g,%.6g,%.6g,%.0f,%.0f,%.0f,%.3f,%.3f,%.3f\n", alg,
+		ELEM_NAME, g->N, g->p, g->q, g->c, nproc, nthreads, wall, r,
+		d[0], d[1], d[2], k, t[T_BCAST], t[T_SHIFT], t[T_COMPUTE],
+		a[T_BCAST], a[T_SHIFT], a[T_COMPUTE],
+		(t[T_COMPUTE] > 0.0) ? a[T_COMPUTE]/t[T_COMPUTE]*1e-9 : 0.0,
+		(t[T_BCAST] > 0.0) ? a[T_BCAST]/t[T_BCAST]*1e-9 : 0.0,
+		(t[T_SHIFT] > 0.0) ? a[T_SHIFT]/t[T_SHIFT]*1e-9 : 0.0);
+      }
+    }
+    fclose(fp);
+  }
+  free(all);
+  free(counts);
+  free(displs);
+}
+
+
+/* The out-of-core mode, for matrices bigger than the memory of all
+   processes together. The result is divided into tiles of order tile,
+   which are dealt out to the processes in turn. For its tile (i,j) of
+   Z a process reads the tiles (i,k) of X and (k,j) of Y from the files
+   one k at a time, multiplies them with the blocked kernel and writes
+   the finished tile to the output file, all with independent MPI-IO.
+   The tiles of the next step are read with nonblocking reads while
+   the current ones are multiplied, and the finished tiles are written
+   while the next ones are computed, so every process only holds a few
+   tiles whatever the size of the matrices. */
+typedef struct {
+  MPI_File fh;
+  matrix_header_t hdr;          /* Header of the file, made up for old
+				   files of floats without one */
+  MPI_Offset disp;              /* Offset of the first element */
+  MPI_Datatype etype;
+  int size;                     /* Size of an element in bytes */
+  int max_req;                  /* Max nr of reads for one tile */
+} ooc_file_t;
+
+/* Opens the input file fn with an N*N matrix on the grid for reading
+   tiles of order tile. Returns zero in all processes if the file
+   couldn't be opened, is too short or doesn't match its header */
+static int ooc_open(ooc_file_t *f, char *fn, int N, int tile, grid_t *g) {
+  MPI_Offset size;
+  long ft;
+
+  if (MPI_File_open(g->grid_comm, fn, MPI_MODE_RDONLY, MPI_INFO_NULL, &f->fh)
+      != MPI_SUCCESS) return(0);
+  MPI_File_get_size(f->fh, &size);
+  memset(&f->hdr, 0, sizeof(f->hdr));
+  if (size >= MATRIX_HEADER_SIZE)
+    MPI_File_read_at_all(f->fh, 0, &f->hdr, sizeof(f->hdr), MPI_BYTE,
+			 MPI_STATUS_IGNORE);
+  f->disp = 0;
+  if (f->hdr.magic == MATRIX_MAGIC) {
+    f->disp = MATRIX_HEADER_SIZE;
+    if (!matrix_header_ok(&f->hdr) || f->hdr.rows != (uint64_t) N ||
+	f->hdr.cols != (uint64_t) N) {
+      MPI_File_close(&f->fh);
+      return(0);
+    }
+  } else {
+    matrix_header(&f->hdr, MATRIX_FLOAT, N, N, MATRIX_ROWMAJOR, 0);
+    f->hdr.magic = 0;
+  }
+  f->size = matrix_elem_size(f->hdr.type);
+  f->etype = file_etype(f->hdr.type);
+  if (size < f->disp+(MPI_Offset) f->size*N*N) {
+    MPI_File_close(&f->fh);
+    return(0);
+  }
+  /* A row of a tile crosses at most tile/ft+2 tiles of the file */
+  ft = (f->hdr.layout == MATRIX_TILED) ? (long) f->hdr.tile : N;
+  f->max_req = tile*(tile/ft+2);
+  return(1);
+}
+
+/* Starts reading the m*n tile of f at row i0 and column j0 into buf,
+   row by row in the element type of the file. Pieces that follow each
+   other both in the file and in buf are read together, so a whole tile
+   of a tiled file of the same tile size is one read. Returns the nr
+   of requests put in req */
+static int ooc_read_tile(ooc_file_t *f, long i0, long j0, int m, int n,
+			 char *buf, MPI_Request *req) {
+  long ft, i, j, w, off, pos, start = 0, bstart = 0, len = 0;
+  int nreq = 0;
+
+  ft = (f->hdr.layout == MATRIX_TILED) ? (long) f->hdr.tile : (long) f->hdr.cols;
+  for (i=i0; i<i0+m; i++) {
+    for (j=j0; j<j0+n; j+=w) {
+      w = ((j/ft+1)*ft < j0+n) ? (j/ft+1)*ft-j : j0+n-j;
+      off = matrix_index(&f->hdr, i, j);
+      pos = (i-i0)*n+j-j0;
+      if (len > 0 && off == start+len && pos == bstart+len) {
+	len += w;
+      } else {
+	if (len > 0)
+	  MPI_File_iread_at(f->fh, f->disp+(MPI_Offset) f->size*start,
+			    buf+f->size*bstart, (int) len, f->etype,
+			    &req[nreq++]);
+	start = off;
+	bstart = pos;
+	len = w;
+      }
+    }
+  }
+  MPI_File_iread_at(f->fh, f->disp+(MPI_Offset) f->size*start,
+		    buf+f->size*bstart, (int) len, f->etype, &req[nreq++]);
+  return(nreq);
+}
+
+/* Converts the m*n tile in buf, as read from f, to elem_t in M and
+   returns its checksum */
+static uint64_t ooc_convert(ooc_file_t *f, char *buf, long i0, long j0,
+			    int m, int n, elem_t *M) {
+  uint64_t sum = 0;
+  long i, k, N = f->hdr.cols;
+
+  for (i=0; i<m; i++)
+    sum += matrix_checksum_type(buf+(long) f->size*i*n, f->hdr.type, n,
+				(i0+i)*N+j0);
+  for (k=0; k<(long) m*n; k++) M[k] = matrix_get(buf, f->hdr.type, k);
+  return(sum);
+}
+
+/* Multiplies the N*N matrices in the files fn1 and fn2 out of core in
+   tiles of order tile, and writes the result to fn3. The checksums of
+   the input files are verified on the way, with every tile of X
+   counted by the process with tile (i,0) of Z and every tile of Y by
+   the process with tile (0,j). Process 0 reports how long the
+   processes waited for I/O. Returns zero in all processes if a file
+   couldn't be read or written, otherwise 1 */
+int ooc_multiply(grid_t *g, char *fn1, char *fn2, char *fn3, int tile,
+		 int verbose) {
+  const long N = g->N;
+  long nt;
+  ooc_file_t fx, fy;
+  MPI_File fz;
+  matrix_header_t hdr;
+  MPI_Request *xreq[2], *yreq[2], *zreq[2];
+  int nx[2] = {0, 0}, ny[2] = {0, 0}, nz[2] = {0, 0};
+  char *xbuf[2], *ybuf[2];
+  elem_t *Xt, *Yt;
+  acc_t *Zt[2];
+  long s, steps, t, i, j, k, r;
+  int rank, nproc, b, zb = 0, m, n, w, ok, all_ok;
+  uint64_t sum[3] = {0, 0, 0}, all_sum[3], cs;
+  double t0, io_wait = 0.0, compute = 0.0, times[2], max_times[2];
+
+  MPI_Comm_rank(g->grid_comm, &rank);
+  MPI_Comm_size(g->grid_comm, &nproc);
+  if (tile > N) tile = N;
+  nt = (N+tile-1)/tile;
+  if (!ooc_open(&fx, fn1, N, tile, g)) return(0);
+  if (!ooc_open(&fy, fn2, N, tile, g)) {
+    MPI_File_close(&fx.fh);
+    return(0);
+  }
+  if (MPI_File_open(g->grid_comm, fn3, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+		    MPI_INFO_NULL, &fz) != MPI_SUCCESS) {
+    MPI_File_close(&fx.fh);
+    MPI_File_close(&fy.fh);
+    return(0);
+  }
+  MPI_File_set_size(fz, MATRIX_HEADER_SIZE+(MPI_Offset) sizeof(acc_t)*N*N);
+
+  /* Two buffers of everything, for the step that is computed and the
+     one that is read or written meanwhile */
+  for (b=0; b<2; b++) {
+    xbuf[b] = (char *) malloc((size_t) fx.size*tile*tile);
+    ybuf[b] = (char *) malloc((size_t) fy.size*tile*tile);
+    xreq[b] = (MPI_Request *) malloc(sizeof(MPI_Request)*fx.max_req);
+    yreq[b] = (MPI_Request *) malloc(sizeof(MPI_Request)*fy.max_req);
+    zreq[b] = (MPI_Request *) malloc(sizeof(MPI_Request)*tile);
+    Zt[b] = (acc_t *) malloc(sizeof(acc_t)*tile*tile);
+  }
+  Xt = (elem_t *) malloc(sizeof(elem_t)*tile*tile);
+  Yt = (elem_t *) malloc(sizeof(elem_t)*tile*tile);
+  if (verbose) {
+    printf("Multiplying out of core in tiles of order %d, %.0f MB per process\n",
+	   tile, (2.0*(fx.size+fy.size+sizeof(acc_t))+2.0*sizeof(elem_t))*
+	   tile*tile/(1 << 20));
+    fflush(stdout);
+  }
+
+  /* Step s multiplies tiles k = s%nt for the tile of Z numbered
+     rank+(s/nt)*nproc, counting them row by row */
+  steps = (nt*nt > rank) ? ((nt*nt-rank+nproc-1)/nproc)*nt : 0;
+  for (s=0; s<=steps; s++) {
+    /* Start reading the tiles of step s, and finish step s-1 */
+    if (s < steps) {
+      b = s%2;
+      t = rank+(s/nt)*nproc;
+      i = t/nt; j = t%nt; k = s%nt;
+      m = min(tile, N-i*tile);
+      n = min(tile, N-j*tile);
+      w = min(tile, N-k*tile);
+      nx[b] = ooc_read_tile(&fx, i*tile, k*tile, m, w, xbuf[b], xreq[b]);
+      ny[b] = ooc_read_tile(&fy, k*tile, j*tile, w, n, ybuf[b], yreq[b]);
+    }
+    if (s == 0) continue;
+
+    b = (s-1)%2;
+    t = rank+((s-1)/nt)*nproc;
+    i = t/nt; j = t%nt; k = (s-1)%nt;
+    m = min(tile, N-i*tile);
+    n = min(tile, N-j*tile);
+    w = min(tile, N-k*tile);
+    t0 = MPI_Wtime();
+    MPI_Waitall(nx[b], xreq[b], MPI_STATUSES_IGNORE);
+    MPI_Waitall(ny[b], yreq[b], MPI_STATUSES_IGNORE);
+    if (k == 0) {
+      /* A new tile of Z, in the buffer whose write is done */
+      zb = ((s-1)/nt)%2;
+      MPI_Waitall(nz[zb], zreq[zb], MPI_STATUSES_IGNORE);
+      memset(Zt[zb], 0, sizeof(acc_t)*m*n);
+    }
+    io_wait += MPI_Wtime()-t0;
+
+    t0 = MPI_Wtime();
+    cs = ooc_convert(&fx, xbuf[b], i*tile, k*tile, m, w, Xt);
+    if (j == 0) sum[0] += cs;
+    cs = ooc_convert(&fy, ybuf[b], k*tile, j*tile, w, n, Yt);
+    if (i == 0) sum[1] += cs;
+    local_gemm(m, n, w, Xt, w, Yt, n, Zt[zb], n);
+    compute += MPI_Wtime()-t0;
+
+    if (k == nt-1) {
+      /* The tile of Z is done, start writing it */
+      for (r=0; r<m; r++)
+	sum[2] += matrix_checksum_t(Zt[zb]+r*n, n, (i*tile+r)*N+j*tile);
+      nz[zb] = 0;
+      if (n == N) {
+	MPI_File_iwrite_at(fz, MATRIX_HEADER_SIZE+(MPI_Offset) sizeof(acc_t)*
+			   i*tile*N, Zt[zb], m*n, MPI_ACC, &zreq[zb][nz[zb]++]);
+      } else {
+	for (r=0; r<m; r++)
+	  MPI_File_iwrite_at(fz, MATRIX_HEADER_SIZE+(MPI_Offset) sizeof(acc_t)*
+			     ((i*tile+r)*N+j*tile), Zt[zb]+r*n, n, MPI_ACC,
+			     &zreq[zb][nz[zb]++]);
+      }
+    }
+  }
+  t0 = MPI_Wtime();
+  MPI_Waitall(nz[0], zreq[0], MPI_STATUSES_IGNORE);
+  MPI_Waitall(nz[1], zreq[1], MPI_STATUSES_IGNORE);
+  io_wait += MPI_Wtime()-t0;
+
+  /* Check the inputs and write the header of the result */
+  MPI_Reduce(sum, all_sum, 3, MPI_UINT64_T, MPI_SUM, 0, g->grid_comm);
+  ok = 1;
+  if (rank == 0) {
+    if (fx.hdr.magic == MATRIX_MAGIC && all_sum[0] != fx.hdr.checksum) {
+      printf("Checksum error in file %s\n", fn1);
+      ok = 0;
+    }
+    if (fy.hdr.magic == MATRIX_MAGIC && all_sum[1] != fy.hdr.checksum) {
+      printf("Checksum error in file %s\n", fn2);
+      ok = 0;
+    }
+    matrix_header(&hdr, MATRIX_TYPE_OF(Zt[0]), N, N,
+		  MATRIX_ROWMAJOR, 0);
+    hdr.checksum = all_sum[2];
+    ok = (MPI_File_write_at(fz, 0, &hdr, sizeof(hdr), MPI_BYTE,
+			    MPI_STATUS_IGNORE) == MPI_SUCCESS) && ok;
+  }
+  MPI_File_close(&fx.fh);
+  MPI_File_close(&fy.fh);
+  MPI_File_close(&fz);
+  MPI_Allreduce(&ok, &all_ok, 1, MPI_INT, MPI_LAND, g->grid_comm);
+
+  times[0] = io_wait;
+  times[1] = compute;
+  MPI_Reduce(times, max_times, 2, MPI_DOUBLE, MPI_MAX, 0, g->grid_comm);
+  if (rank == 0) {
+    printf("    %ld tiles of Z, at most %.2f s waiting for I/O and %.2f s computing in a process\n",
+	   nt*nt, max_times[0], max_times[1]);
+    fflush(stdout);
+  }
+
+  for (b=0; b<2; b++) {
+    free(xbuf[b]);
+    free(ybuf[b]);
+    free(xreq[b]);
+    free(yreq[b]);
+    free(zreq[b]);
+    free(Zt[b]);
+  }
+  free(Xt);
+  free(Yt);
+  return(all_ok);
+}
+
+
+/* Blocked LU factorization with partial pivoting, in the manner of
+   HPL. The N*N matrix A is distributed 2-D block-cyclically over the
+   p*q grid in blocks of nb*nb: block (I,J) is stored in process
+   (I mod p, J mod q), and the blocks of a process are packed together
+   row by row into its local matrix. The factorization is right-looking:
+   for every panel of nb columns the process column that holds it
+   factors it, searching the pivot of each column along col_comm, and
+   broadcasts L along the rows. The row interchanges are applied to the
+   rest of the matrix, the process row with the diagonal block solves
+   for its rows of U and broadcasts them down the columns, and every
+   process updates its part of the trailing matrix with the blocked
+   GEMM kernel. The computation is done in doubles, whatever the
+   element type of the build, and A is overwritten by L and U as in
+   LAPACK's dgetrf, with the row interchanges in ipiv. */
+
+/* The number of the global indexes 0..g-1 that process iproc of nprocs
+   holds in a block-cyclic distribution with blocks of nb. For g=N it
+   is the size of the local part, and otherwise the local index of the
+   first global index at or after g */
+static int cyclic_count(int g, int nb, int iproc, int nprocs) {
+  int b = g/nb;
+  return((b/nprocs)*nb+((b%nprocs > iproc) ? nb : 0)+
+	 ((b%nprocs == iproc) ? g%nb : 0));
+}
+
+/* The global index of local index l in process iproc */
+static int cyclic_global(int l, int nb, int iproc, int nprocs) {
+  return(((l/nb)*nprocs+iproc)*nb+l%nb);
+}
+
+/* Reads the block-cyclic part of the N*N matrix in file fn into the
+   mloc*nloc local matrix A of doubles, through a file view made with
+   MPI_Type_create_darray. The file must be stored row by row, and
+   the checksum in its header is verified. Returns zero in all
+   processes if the file couldn't be read, otherwise 1 */
+int lu_read_matrix(double *A, char *fn, grid_t *g, int N, int nb, int mloc,
+		   int nloc) {
+  MPI_File fh;
+  MPI_Datatype darray, etype;
+  MPI_Offset size, disp = 0;
+  matrix_header_t hdr;
+  int gsizes[2], distribs[2], dargs[2], psizes[2];
+  int ok, all_ok, type, rank, l, c, gi, gj, len;
+  uint64_t sum = 0, all_sum;
+  char *buf;
+  long i;
+
+  if (MPI_File_open(g->grid_comm, fn, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh)
+      != MPI_SUCCESS) return(0);
+  MPI_File_get_size(fh, &size);
+  memset(&hdr, 0, sizeof(hdr));
+  if (size >= MATRIX_HEADER_SIZE)
+    MPI_File_read_at_all(fh, 0, &hdr, sizeof(hdr), MPI_BYTE,
+			 MPI_STATUS_IGNORE);
+  if (hdr.magic == MATRIX_MAGIC) {
+    disp = MATRIX_HEADER_SIZE;
+    if (!matrix_header_ok(&hdr) || hdr.rows != (uint64_t) N ||
+	hdr.cols != (uint64_t) N || hdr.layout != MATRIX_ROWMAJOR) {
+      MPI_File_close(&fh);
+      return(0);
+    }
+  }
+  type = (hdr.magic == MATRIX_MAGIC) ? (int) hdr.type : MATRIX_FLOAT;
+  etype = file_etype(type);
+  if (size < disp+(MPI_Offset) matrix_elem_size(type)*N*N) {
+    MPI_File_close(&fh);
+    return(0);
+  }
+
+  /* The ranks of grid_comm run row by row over the grid, as darray
+     expects for MPI_ORDER_C */
+  MPI_Comm_rank(g->grid_comm, &rank);
+  gsizes[0] = gsizes[1] = N;
+  distribs[0] = distribs[1] = MPI_DISTRIBUTE_CYCLIC;
+  dargs[0] = dargs[1] = nb;
+  psizes[0] = g->p;
+  psizes[1] = g->q;
+  MPI_Type_create_darray(g->p*g->q, rank, 2, gsizes, distribs, dargs, psizes,
+			 MPI_ORDER_C, etype, &darray);
+  MPI_Type_commit(&darray);
+  buf = (char *) malloc((long) matrix_elem_size(type)*mloc*nloc+1);
+  MPI_File_set_view(fh, disp, etype, darray, "native", MPI_INFO_NULL);
+  ok = (MPI_File_read_at_all(fh, 0, buf, mloc*nloc, etype, MPI_STATUS_IGNORE)
+	== MPI_SUCCESS);
+  MPI_File_close(&fh);
+  MPI_Type_free(&darray);
+
+  /* The local rows hold runs of up to nb consecutive elements of the
+     global rows, which are summed one run at a time */
+  for (l=0; l<mloc; l++) {
+    gi = cyclic_global(l, nb, g->my_row, g->p);
+    for (c=0; c<nloc; c+=len) {
+      gj = cyclic_global(c, nb, g->my_col, g->q);
+      len = min(nb-c%nb, nloc-c);
+      sum += matrix_checksum_type(buf+(long) matrix_elem_size(type)*
+				  ((long) l*nloc+c), type, len,
+				  (long) gi*N+gj);
+    }
+  }
+  for (i=0; i<(long) mloc*nloc; i++) A[i] = matrix_get(buf, type, i);
+  free(buf);
+
+  MPI_Allreduce(&ok, &all_ok, 1, MPI_INT, MPI_LAND, g->grid_comm);
+  MPI_Allreduce(&sum, &all_sum, 1, MPI_UINT64_T, MPI_SUM, g->grid_comm);
+  if (all_ok && hdr.magic == MATRIX_MAGIC && all_sum != hdr.checksum) {
+    if (g->my_row == 0 && g->my_col == 0)
+      printf("Checksum error in file %s\n", fn);
+    all_ok = 0;
+  }
+  return(all_ok);
+}
+
+/* Swaps the columns c0..c1-1 of the global rows r1 and r2 of the local
+   matrix A, with nloc columns, between the processes of the column
+   that hold them. buf has room for c1-c0 doubles */
+static void lu_swap_rows(grid_t *g, double *A, int nloc, int nb, int r1,
+			 int r2, int c0, int c1, double *buf) {
+  int o1 = (r1/nb)%g->p, o2 = (r2/nb)%g->p, l1, l2, c;
+  double *a1, *a2, x;
+  MPI_Status status;
+
+  if (r1 == r2 || c0 >= c1) return;
+  l1 = (r1/(nb*g->p))*nb+r1%nb;
+  l2 = (r2/(nb*g->p))*nb+r2%nb;
+  a1 = A+(long) l1*nloc;
+  a2 = A+(long) l2*nloc;
+  if (o1 == g->my_row && o2 == g->my_row) {
+    for (c=c0; c<c1; c++) {
+      x = a1[c]; a1[c] = a2[c]; a2[c] = x;
+    }
+  } else if (o1 == g->my_row || o2 == g->my_row) {
+    double *a = (o1 == g->my_row) ? a1 : a2;
+    memcpy(buf, a+c0, sizeof(double)*(c1-c0));
+    MPI_Sendrecv(buf, c1-c0, MPI_DOUBLE, (o1 == g->my_row) ? o2 : o1,
+		 datatag, a+c0, c1-c0, MPI_DOUBLE,
+		 (o1 == g->my_row) ? o2 : o1, datatag, g->col_comm, &status);
+  }
+}
+
+/* Factors the matrix A, distributed block-cyclically over the grid in
+   blocks of nb, into P*A = L*U, overwriting A with L and U and
+   storing the row interchanges in ipiv, which all processes get.
+   times gets the time spent in the panel factorization, in the
+   communication and in the updates. Returns zero if a pivot was zero,
+   in which case the matrix is singular and U can't be used */
+int lu_factor(grid_t *g, double *A, int N, int nb, int *ipiv,
+	      double times[3], int verbose) {
+  const int p = g->p, q = g->q;
+  const int mloc = cyclic_count(N, nb, g->my_row, p);
+  const int nloc = cyclic_count(N, nb, g->my_col, q);
+  int k0, w, j, l, c, prow, pcol, r0, rb, lc0, pc0, pc1, cr, len, nonsingular = 1;
+  double *Lbuf, *Ubuf, *urow, *buf, *a, t;
+  struct { double v; int i; } loc, piv;
+
+  Lbuf = (double *) malloc(sizeof(double)*((long) mloc*nb+1));
+  Ubuf = (double *) malloc(sizeof(double)*((long) nb*nloc+1));
+  urow = (double *) malloc(sizeof(double)*nb);
+  buf = (double *) malloc(sizeof(double)*(nloc+1));
+  times[0] = times[1] = times[2] = 0.0;
+
+  for (k0=0; k0<N; k0+=nb) {
+    w = min(nb, N-k0);
+    prow = (k0/nb)%p;
+    pcol = (k0/nb)%q;
+    r0 = cyclic_count(k0, nb, g->my_row, p);    /* First local row >= k0 */
+    rb = cyclic_count(k0+w, nb, g->my_row, p);  /* and below the panel */
+    cr = cyclic_count(k0+w, nb, g->my_col, q);  /* First local column right */
+    if (verbose && k0/nb%16 == 0) {
+      printf("    panel %d..%d\n", k0, k0+w-1);
+      fflush(stdout);
+    }
+
+    /* The process column pcol factors the panel one column at a time,
+       the pivot is the element of largest magnitude in the column on
+       or below the diagonal, found with MPI_MAXLOC */
+    t = MPI_Wtime();
+    pc0 = pc1 = cyclic_count(k0, nb, g->my_col, q);
+    if (g->my_col == pcol) {
+      pc1 = pc0+w;
+      for (j=k0; j<k0+w; j++) {
+	lc0 = pc0+j-k0;
+	loc.v = -1.0;
+	loc.i = N;
+	for (l=cyclic_count(j, nb, g->my_row, p); l<mloc; l++) {
+	  if (fabs(A[(long) l*nloc+lc0]) > loc.v) {
+	    loc.v = fabs(A[(long) l*nloc+lc0]);
+	    loc.i = cyclic_global(l, nb, g->my_row, p);
+	  }
+	}
+	MPI_Allreduce(&loc, &piv, 1, MPI_DOUBLE_INT, MPI_MAXLOC, g->col_comm);
+	ipiv[j] = piv.i;
+	lu_swap_rows(g, A, nloc, nb, j, piv.i, pc0, pc1, buf);
+
+	/* The row with the pivot goes to the whole process column, which
+	   scales its part of the column and updates the rest of the panel */
+	len = pc1-lc0;
+	if ((j/nb)%p == g->my_row)
+	  memcpy(urow, A+(long) cyclic_count(j, nb, g->my_row, p)*nloc+lc0,
+		 sizeof(double)*len);
+	MPI_Bcast(urow, len, MPI_DOUBLE, (j/nb)%p, g->col_comm);
+	if (urow[0] == 0.0) {
+	  nonsingular = 0;
+	  continue;
+	}
+	for (l=cyclic_count(j+1, nb, g->my_row, p); l<mloc; l++) {
+	  a = A+(long) l*nloc+lc0;
+	  a[0] /= urow[0];
+	  for (c=1; c<len; c++) a[c] -= a[0]*urow[c];
+	}
+      }
+      /* Pack the panel from row k0 down for the broadcast */
+      for (l=r0; l<mloc; l++)
+	memcpy(Lbuf+(long) (l-r0)*w, A+(long) l*nloc+pc0, sizeof(double)*w);
+    }
+    times[0] += MPI_Wtime()-t;
+
+    /* Broadcast the panel and the pivots along the rows, and apply the
+       interchanges to the columns on both sides of the panel */
+    t = MPI_Wtime();
+    MPI_Bcast(Lbuf, (mloc-r0)*w, MPI_DOUBLE, pcol, g->row_comm);
+    MPI_Bcast(ipiv+k0, w, MPI_INT, pcol, g->row_comm);
+    for (j=k0; j<k0+w; j++) {
+      lu_swap_rows(g, A, nloc, nb, j, ipiv[j], 0, pc0, buf);
+      lu_swap_rows(g, A, nloc, nb, j, ipiv[j], pc1, nloc, buf);
+    }
+    times[1] += MPI_Wtime()-t;
+
+    /* The process row prow solves L11*U12 = A12 for its columns right
+       of the panel, L11 being the unit lower triangle at the top of
+       the panel, and broadcasts U12 down the columns */
+    t = MPI_Wtime();
+    len = nloc-cr;
+    if (g->my_row == prow) {
+      for (j=1; j<w; j++) {
+	a = A+(long) (r0+j)*nloc+cr;
+	for (l=0; l<j; l++) {
+	  double x = Lbuf[(long) j*w+l];
+	  double *u = A+(long) (r0+l)*nloc+cr;
+	  for (c=0; c<len; c++) a[c] -= x*u[c];
+	}
+      }
+      for (j=0; j<w; j++)
+	memcpy(Ubuf+(long) j*len, A+(long) (r0+j)*nloc+cr, sizeof(double)*len);
+    }
+    times[2] += MPI_Wtime()-t;
+    t = MPI_Wtime();
+    MPI_Bcast(Ubuf, w*len, MPI_DOUBLE, prow, g->col_comm);
+    times[1] += MPI_Wtime()-t;
+
+    /* A22 -= L21*U12 with the GEMM kernel, by adding -L21*U12 */
+    t = MPI_Wtime();
+    if (mloc > rb && len > 0) {
+      a = Lbuf+(long) (rb-r0)*w;
+      for (l=0; l<(mloc-rb)*w; l++) a[l] = -a[l];
+      if (nthreads > 0)
+	matrixmult_gemm_slice_d(mloc-rb, len, w, a, w, Ubuf, len,
+				A+(long) rb*nloc+cr, nloc, blocksize);
+      else
+	matrixmult_gemm_d(mloc-rb, len, w, a, w, Ubuf, len,
+			  A+(long) rb*nloc+cr, nloc, blocksize);
+    }
+    times[2] += MPI_Wtime()-t;
+  }
+
+  free(Lbuf);
+  free(Ubuf);
+  free(urow);
+  free(buf);
+  MPI_Allreduce(MPI_IN_PLACE, &nonsingular, 1, MPI_INT, MPI_LAND,
+		g->grid_comm);
+  return(nonsingular);
+}
+
+/* Checks the factorization P*A = L*U as Freivalds' algorithm checks
+   products: for a random vector r, (P*A)*r is compared with L*(U*r).
+   A0 is the original matrix and LU the factored one, distributed in
+   the same way. The vectors are summed along the rows and gathered
+   along the columns in full, so every process has U*r and A*r. Row i
+   passes if the difference is at most 4*N*eps*(|L|*(|U|*|r|))_i,
+   which bounds the backward error of the factorization and the
+   rounding in the check. Returns the largest ratio of the difference
+   to this bound, so the check passes if it is at most 1 */
+double lu_check(grid_t *g, double *A0, double *LU, int N, int nb,
+		int *ipiv, int trials, uint64_t seed) {
+  const int mloc = cyclic_count(N, nb, g->my_row, g->p);
+  const int nloc = cyclic_count(N, nb, g->my_col, g->q);
+  double *r, *loc, *v, x, ratio = 0.0, all_ratio, bound;
+  int trial, l, c, i, j;
+
+  r = (double *) malloc(sizeof(double)*nloc);
+  loc = (double *) malloc(sizeof(double)*3*mloc);
+  v = (double *) malloc(sizeof(double)*3*N);
+
+  for (trial=0; trial<trials; trial++) {
+    for (c=0; c<nloc; c++)
+      r[c] = matrix_random(seed, MATRIX_RAND_UNIFORM, (uint64_t) trial*N+
+			   cyclic_global(c, nb, g->my_col, g->q));
+
+    /* U*r, |U|*|r| and A*r, summed along the rows and gathered in full */
+    memset(loc, 0, sizeof(double)*3*mloc);
+    for (l=0; l<mloc; l++) {
+      i = cyclic_global(l, nb, g->my_row, g->p);
+      for (c=0; c<nloc; c++) {
+	j = cyclic_global(c, nb, g->my_col, g->q);
+	if (j >= i) {
+	  loc[l] += LU[(long) l*nloc+c]*r[c];
+	  loc[mloc+l] += fabs(LU[(long) l*nloc+c]*r[c]);
+	}
+	loc[2*mloc+l] += A0[(long) l*nloc+c]*r[c];
+      }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, loc, 3*mloc, MPI_DOUBLE, MPI_SUM, g->row_comm);
+    memset(v, 0, sizeof(double)*3*N);
+    for (l=0; l<mloc; l++) {
+      i = cyclic_global(l, nb, g->my_row, g->p);
+      v[i] = loc[l];
+      v[N+i] = loc[mloc+l];
+      v[2*N+i] = loc[2*mloc+l];
+    }
+    MPI_Allreduce(MPI_IN_PLACE, v, 3*N, MPI_DOUBLE, MPI_SUM, g->col_comm);
+
+    /* Apply the interchanges to A*r */
+    for (i=0; i<N; i++) {
+      x = v[2*N+i]; v[2*N+i] = v[2*N+ipiv[i]]; v[2*N+ipiv[i]] = x;
+    }
+
+    /* L*(U*r) and |L|*(|U|*|r|), L having a unit diagonal */
+    memset(loc, 0, sizeof(double)*2*mloc);
+    for (l=0; l<mloc; l++) {
+      i = cyclic_global(l, nb, g->my_row, g->p);
+      for (c=0; c<nloc; c++) {
+	j = cyclic_global(c, nb, g->my_col, g->q);
+	if (j >= i) break;
+	loc[l] += LU[(long) l*nloc+c]*v[j];
+	loc[mloc+l] += fabs(LU[(long) l*nloc+c])*v[N+j];
+      }
+    }
+    MPI_Allreduce(MPI_IN_PLACE, loc, 2*mloc, MPI_DOUBLE, MPI_SUM, g->row_comm);
+
+    for (l=0; l<mloc; l++) {
+      i = cyclic_global(l, nb, g->my_row, g->p);
+      bound = 4.0*N*DBL_EPSILON*(loc[mloc+l]+v[N+i])+DBL_MIN;
+      ratio = fmax(ratio, fabs(loc[l]+v[i]-v[2*N+i])/bound);
+    }
+  }
+  MPI_Allreduce(&ratio, &all_ratio, 1, MPI_DOUBLE, MPI_MAX, g->grid_comm);
+
+  free(r);
+  free(loc);
+  free(v);
+  return(all_ratio);
+}
+
+/* Reads the N*N matrix in file fn, factors it with lu_factor in blocks
+   of nb and reports the time and the GFLOP/s, counting 2/3*N^3 flops
+   as HPL does. With verify>0 the factors are checked with lu_check
+   with that many vectors. Returns zero in all processes if the file
+   couldn't be read, the matrix is singular or the check failed */
+int lu_run(grid_t *g, char *fn, int N, int nb, int verify, int verbose) {
+  const int mloc = cyclic_count(N, nb, g->my_row, g->p);
+  const int nloc = cyclic_count(N, nb, g->my_col, g->q);
+  double *A, *A0 = NULL, times[3], max_times[3], elapsed, ratio, t;
+  int *ipiv, ok, rank;
+  uint64_t seed;
+
+  MPI_Comm_rank(g->grid_comm, &rank);
+  A = (double *) malloc(sizeof(double)*((long) mloc*nloc+1));
+  ipiv = (int *) malloc(sizeof(int)*N);
+  if (!lu_read_matrix(A, fn, g, N, nb, mloc, nloc)) {
+    if (rank == 0) {
+      printf("error in reading file %s, which has to be stored row by row\n",
+	     fn);
+      fflush(stdout);
+    }
+    free(A);
+    free(ipiv);
+    return(0);
+  }
+  if (verify) {
+    A0 = (double *) malloc(sizeof(double)*((long) mloc*nloc+1));
+    memcpy(A0, A, sizeof(double)*mloc*nloc);
+  }
+
+  MPI_Barrier(g->grid_comm);
+  elapsed = MPI_Wtime();
+  ok = lu_factor(g, A, N, nb, ipiv, times, verbose);
+  elapsed = MPI_Wtime()-elapsed;
+  MPI_Reduce(times, max_times, 3, MPI_DOUBLE, MPI_MAX, 0, g->grid_comm);
+  if (rank == 0) {
+    printf("Time for LU factorization %6.1f seconds, %.2f GFLOP/s\n", elapsed,
+	   2.0/3.0*N*N*(double) N/elapsed*1e-9);
+    printf("    panels %.3f s, communication %.3f s, updates %.3f s max\n",
+	   max_times[0], max_times[1], max_times[2]);
+    if (!ok) printf("    the matrix is singular\n");
+    fflush(stdout);
+  }
+
+  if (verify && ok) {
+    seed = (uint64_t) (MPI_Wtime()*1e6);
+    MPI_Bcast(&seed, 1, MPI_UINT64_T, 0, g->grid_comm);
+    t = MPI_Wtime();
+    ratio = lu_check(g, A0, A, N, nb, ipiv, verify, seed);
+    if (rank == 0) {
+      printf("    check of P*A = L*U with %d vectors %s in %.2f seconds, "
+	     "error %.3g of the rounding bound\n", verify,
+	     (ratio <= 1.0) ? "passed" : "FAILED", MPI_Wtime()-t, ratio);
+      fflush(stdout);
+    }
+    ok = (ratio <= 1.0);
+  }
+
+  free(A);
+  free(A0);
+  free(ipiv);
+  return(ok);
+}
+
+/* Matrix powers and chains of products. The matrices of a chain are
+   read once, and the intermediate products stay in the grid in the
+   same block layout as the matrices read from the files, so they are
+   multiplied further without any file I/O or gathering. Every product
+   of an M*K and a K*N matrix is done with the sizes of the grid set by
+   grid_set_sizes. The intermediate products are converted to elem_t,
+   which rounds them to floats with -DFOX_MIXED. */
+
+/* A chain of n matrices A_0*A_1*...*A_{n-1}, where A_i is
+   dims[i]*dims[i+1], or a power A^power of the one matrix A_0, and
+   the algorithm they are multiplied with */
+typedef struct {
+  grid_t *g;
+  int n, power;
+  int *dims;
+  int *split;                  /* Order of the products, see chain_order */
+  elem_t **A;                  /* Local blocks of the matrices */
+  int alg, pipelined, ring;    /* Algorithm, and variant of Fox's */
+  int mults;                   /* Nr of products done */
+  double flops;                /* Flops of the products */
+  int verbose;
+} chain_t;
+
+/* Reads the names of the matrices of a chain from the file fn in
+   process 0, separated by spaces or newlines, and their sizes from
+   the headers of the files into dims. Returns the nr of matrices, or
+   0 if the file couldn't be read or the sizes don't match */
+int read_chain(char *fn, char names[][80], int *dims) {
+  FILE *f;
+  char extra[80];
+  long rows, cols;
+  int n = 0, bad = 0;
+
+  if ((f=fopen(fn, "r")) == NULL) {
+    printf("Couldn't open the chain %s\n", fn);
+    return(0);
+  }
+  while (n < MAX_CHAIN && fscanf(f, "%79s", names[n]) == 1) {
+    if (!matrix_shape(names[n], &rows, &cols)) {
+      printf("Couldn't get the size of the matrix in %s\n", names[n]);
+      bad = 1;
+      break;
+    }
+    if (n > 0 && rows != dims[n]) {
+      printf("The matrix in %s has %ld rows, the one in %s has %d columns\n",
+	     names[n], rows, names[n-1], dims[n]);
+      bad = 1;
+      break;
+    }
+    dims[n] = (int) rows;
+    dims[++n] = (int) cols;
+  }
+  if (!bad && n == MAX_CHAIN && fscanf(f, "%79s", extra) == 1) {
+    printf("A chain can have at most %d matrices\n", MAX_CHAIN);
+    bad = 1;
+  } else if (!bad && n == 0) {
+    printf("No matrices in the chain %s\n", fn);
+  }
+  fclose(f);
+  return(bad ? 0 : n);
+}
+
+/* Finds the order of the products of the chain of n matrices with the
+   sizes in dims that takes the fewest flops, by dynamic programming
+   over the subchains i..j in order of length. split[i*n+j] is set to
+   the s where the product of the matrices i..j is split into i..s and
+   s+1..j. Returns the nr of flops of the best order */
+double chain_order(int n, const int *dims, int *split) {
+  double *cost, c, best;
+  int len, i, j, s;
+
+  cost = (double *) malloc(sizeof(double)*n*n);
+  for (i=0; i<n; i++) cost[i*n+i] = 0.0;
+  for (len=2; len<=n; len++) {
+    for (i=0; i+len<=n; i++) {
+      j = i+len-1;
+      cost[i*n+j] = -1.0;
+      for (s=i; s<j; s++) {
+	c = cost[i*n+s]+cost[(s+1)*n+j]+
+	  2.0*dims[i]*(double) dims[s+1]*dims[j+1];
+	if (cost[i*n+j] < 0.0 || c < cost[i*n+j]) {
+	  cost[i*n+j] = c;
+	  split[i*n+j] = s;
+	}
+      }
+    }
+  }
+  best = cost[n-1];
+  free(cost);
+  return(best);
+}
+
+/* Appends the order of the products of the matrices i..j, as in
+   ((A1*A2)*A3), to the string s */
+void chain_string(char *s, int n, const int *split, int i, int j) {
+  if (i == j) {
+    sprintf(s+strlen(s), "A%d", i+1);
+    return;
+  }
+  strcat(s, "(");
+  chain_string(s, n, split, i, split[i*n+j]);
+  strcat(s, "*");
+  chain_string(s, n, split, split[i*n+j]+1, j);
+  strcat(s, ")");
+}
+
+/* Multiplies the M*K matrix with the local block X by the K*N matrix
+   with the local block Y into Z, which has room for the block of the
+   product. X and Y may be the same block */
+static void chain_mult(chain_t *c, int M, int K, int N, elem_t *X,
+		       elem_t *Y, acc_t *Z) {
+  grid_t *g = c->g;
+  elem_t *tmp, *Y_copy = NULL;
+
+  grid_set_sizes(g, M, K, N);
+  memset(Z, 0, sizeof(acc_t)*g->m_local*g->n_local);
+  if (c->verbose) {
+    printf("  multiplying %d*%d by %d*%d\n", M, K, K, N);
+    fflush(stdout);
+  }
+  if (c->alg == SUMMA) {
+    summa(g, X, Y, Z, c->verbose);
+  } else {
+    /* Fox's algorithm shifts the blocks of Y, so a square is taken */
+    /* of a copy */
+    if (X == Y) {
+      Y_copy = (elem_t *) malloc(sizeof(elem_t)*g->y.m*g->y.n);
+      memcpy(Y_copy, Y, sizeof(elem_t)*g->y.m*g->y.n);
+      Y = Y_copy;
+    }
+    tmp = (elem_t *) malloc(sizeof(elem_t)*g->x.m*g->x.n);
+    if (c->ring > 0)
+      fox_stages_ring(g, X, Y, Z, tmp, c->ring, c->verbose);
+    else if (c->pipelined)
+      fox_stages_pipelined(g, X, Y, Z, c->verbose);
+    else
+      fox_stages(g, X, Y, Z, tmp, c->verbose);
+    free(tmp);
+    free(Y_copy);
+  }
+  c->mults++;
+  c->flops += 2.0*M*(double) K*N;
+}
+
+/* Converts the local block Z of a product with size elements to
+   elem_t, into P or into a new block if P is NULL. Returns the block */
+static elem_t *chain_keep(acc_t *Z, long size, elem_t *P) {
+  long i;
+  if (P == NULL) P = (elem_t *) malloc(sizeof(elem_t)*size);
+  for (i=0; i<size; i++) P[i] = (elem_t) Z[i];
+  return(P);
+}
+
+static void chain_product(chain_t *c, int i, int j, acc_t *Z);
+
+/* Returns the local block of the product of the matrices i..j of the
+   chain, which is the block of the matrix itself if i == j and
+   otherwise a new block. Z is room for the product */
+static elem_t *chain_eval(chain_t *c, int i, int j, acc_t *Z) {
+  if (i == j) return(c->A[i]);
+  chain_product(c, i, j, Z);
+  return(chain_keep(Z, (long) c->g->m_local*c->g->n_local, NULL));
+}
+
+/* Multiplies the matrices i..j of the chain, i < j, into Z in the
+   order of c->split, freeing the intermediate products when they have
+   been used */
+static void chain_product(chain_t *c, int i, int j, acc_t *Z) {
+  const int s = c->split[i*c->n+j];
+  elem_t *L, *R;
+
+  L = chain_eval(c, i, s, Z);
+  R = chain_eval(c, s+1, j, Z);
+  chain_mult(c, c->dims[i], c->dims[s+1], c->dims[j+1], L, R, Z);
+  if (L != c->A[i]) free(L);
+  if (R != c->A[s+1]) free(R);
+}
+
+/* Computes the power A^k, k = c->power, of the matrix A of the chain
+   into Z by repeated squaring. The bits of k are taken from the
+   highest one down, squaring the partial power P for every bit and
+   multiplying it by A for the bits that are set. That takes
+   floor(log2 k)+popcount(k)-1 products instead of k-1, the last one
+   straight into Z */
+static void chain_power(chain_t *c, acc_t *Z) {
+  const int N = c->dims[0];
+  elem_t *A = c->A[0], *P = A;
+  int top, b, left = -1;
+  long i, size;
+
+  grid_set_sizes(c->g, N, N, N);
+  size = (long) c->g->m_local*c->g->n_local;
+  for (top=0; (c->power >> top) > 1; top++);    /* Highest bit set */
+  for (b=c->power; b > 0; b >>= 1) left += b & 1;
+  left += top;                                  /* Products to do */
+  if (left == 0) {
+    for (i=0; i<size; i++) Z[i] = A[i];
+    return;
+  }
+  for (b=top-1; b>=0; b--) {
+    chain_mult(c, N, N, N, P, P, Z);
+    if (--left > 0) P = chain_keep(Z, size, (P == A) ? NULL : P);
+    if ((c->power >> b) & 1) {
+      chain_mult(c, N, N, N, P, A, Z);
+      if (--left > 0) P = chain_keep(Z, size, (P == A) ? NULL : P);
+    }
+  }
+  if (P != A) free(P);
+}
+
+/* Sets w to A*v and the second half of w to |A| times the second half
+   of v, where A is the distributed matrix with the local block b, v
+   holds 2*b->cols and w 2*b->rows elements, and both are the same in
+   all processes. The products are summed as in freivalds */
+static void chain_matvec(grid_t *g, const block_t *b, const elem_t *A,
+			 const double *v, double *w) {
+  double *loc, x, a;
+  int i, j;
+
+  loc = (double *) malloc(sizeof(double)*2*b->m);
+  for (i=0; i<b->m; i++) {
+    x = a = 0.0;
+    for (j=0; j<b->n; j++) {
+      x += A[(long) i*b->n+j]*v[b->col0+j];
+      a += fabs(A[(long) i*b->n+j])*v[b->cols+b->col0+j];
+    }
+    loc[i] = x; loc[b->m+i] = a;
+  }
+  MPI_Allreduce(MPI_IN_PLACE, loc, 2*b->m, MPI_DOUBLE, MPI_SUM, g->row_comm);
+  memset(w, 0, sizeof(double)*2*b->rows);
+  for (i=0; i<b->m; i++) {
+    w[b->row0+i] = loc[i];
+    w[b->rows+b->row0+i] = loc[b->m+i];
+  }
+  MPI_Allreduce(MPI_IN_PLACE, w, 2*b->rows, MPI_DOUBLE, MPI_SUM, g->col_comm);
+  free(loc);
+}
+
+/* Freivalds' check of the product Z of the chain, whose block is g->z.
+   For a random vector r, Z*r is compared with A_0*(A_1*(...*(A_{n-1}*r))),
+   or with A*(A*(...*(A*r))) for a power, one product of a matrix with
+   a vector for every factor. Row i passes if the difference is at most
+   4*eps times the sum of the inner dimensions of the chain times
+   (|A_0|*(...*(|A_{n-1}|*|r|)))_i, with the eps of elem_t, which the
+   intermediate products are rounded to. Returns the largest ratio of
+   the difference to this bound, as freivalds does */
+double chain_check(chain_t *c, acc_t *Z, int trials, uint64_t seed) {
+  grid_t *g = c->g;
+  const block_t *bz = &g->z;
+  const int factors = (c->power > 0) ? c->power : c->n;
+  const double eps = (sizeof(elem_t) == sizeof(double)) ?
+    DBL_EPSILON : FLT_EPSILON;
+  double *v, *w, *t, *zr, ratio = 0.0, all_ratio, z, inner = 0.0, bound;
+  int maxdim = 0, trial, f, i, j;
+  block_t b;
+
+  for (i=0; i<=c->n; i++) maxdim = (c->dims[i] > maxdim) ? c->dims[i] : maxdim;
+  for (f=1; f<factors; f++) inner += c->dims[(c->power > 0) ? 0 : f];
+  v = (double *) malloc(sizeof(double)*2*maxdim);
+  w = (double *) malloc(sizeof(double)*2*maxdim);
+  zr = (double *) malloc(sizeof(double)*bz->m);
+
+  for (trial=0; trial<trials; trial++) {
+    /* Every process generates all of r, and its part of Z*r */
+    for (j=0; j<bz->cols; j++) {
+      v[j] = matrix_random(seed, MATRIX_RAND_UNIFORM,
+			   (uint64_t) trial*bz->cols+j);
+      v[bz->cols+j] = fabs(v[j]);
+    }
+    for (i=0; i<bz->m; i++) {
+      z = 0.0;
+      for (j=0; j<bz->n; j++) z += Z[(long) i*bz->n+j]*v[bz->col0+j];
+      zr[i] = z;
+    }
+    MPI_Allreduce(MPI_IN_PLACE, zr, bz->m, MPI_DOUBLE, MPI_SUM, g->row_comm);
+
+    /* Multiply r by the factors from the last one */
+    for (f=factors-1; f>=0; f--) {
+      i = (c->power > 0) ? 0 : f;
+      grid_block(&b, c->dims[i], c->dims[i+1], g->my_row, g->my_col, g->p,
+		 g->q);
+      chain_matvec(g, &b, c->A[i], v, w);
+      t = v; v = w; w = t;
+    }
+
+    for (i=0; i<bz->m; i++) {
+      bound = 4.0*inner*eps*v[bz->rows+bz->row0+i]+DBL_MIN;
+      ratio = fmax(ratio, fabs(zr[i]-v[bz->row0+i])/bound);
+    }
+  }
+  MPI_Allreduce(&ratio, &all_ratio, 1, MPI_DOUBLE, MPI_MAX, g->grid_comm);
+
+  free(v);
+  free(w);
+  free(zr);
+  return(all_ratio);
+}
+
+/* Reads the matrices of the chain c from the files in names, multiplies
+   them in the order that process 0 finds with chain_order, or raises
+   the one matrix to the power c->power, and writes the product to the
+   file fn. Reports the time and the GFLOP/s, and with verify>0 checks
+   the product with chain_check with that many vectors. Returns zero in
+   all processes if a file couldn't be read or written, or the check
+   failed */
+int chain_run(chain_t *c, char names[][80], char *fn, int verify) {
+  grid_t *g = c->g;
+  const int n = c->n;
+  int rank, i, s, maxdim = 0, ok = 1;
+  double best = 0.0, left = 0.0, elapsed, ratio, t;
+  char *order;
+  uint64_t seed;
+  block_t b;
+  acc_t *Z;
+
+  MPI_Comm_rank(g->grid_comm, &rank);
+  c->mults = 0;
+  c->flops = 0.0;
+
+  /* Process 0 finds the best order and gives it to the others */
+  c->split = (int *) calloc(n*n, sizeof(int));
+  if (rank == 0 && c->power == 0) {
+    best = chain_order(n, c->dims, c->split);
+    for (i=1; i<n; i++)
+      left += 2.0*c->dims[0]*(double) c->dims[i]*c->dims[i+1];
+    order = (char *) calloc(8*MAX_CHAIN, sizeof(char));
+    chain_string(order, n, c->split, 0, n-1);
+    printf("Multiplying the chain as %s, %.3g GFLOP instead of %.3g from "
+	   "left to right\n", order, best*1e-9, left*1e-9);
+    fflush(stdout);
+    free(order);
+  }
+  MPI_Bcast(c->split, n*n, MPI_INT, 0, g->grid_comm);
+
+  /* Every process reads its blocks of all the matrices */
+  c->A = (elem_t **) malloc(sizeof(elem_t *)*n);
+  for (i=0; i<n; i++) {
+    grid_block(&b, c->dims[i], c->dims[i+1], g->my_row, g->my_col, g->p,
+	       g->q);
+    c->A[i] = (elem_t *) malloc(sizeof(elem_t)*b.m*b.n);
+    if (ok && !mpiio_read_block(c->A[i], names[i], g, &b)) {
+      if (rank == 0) {
+	printf("error in reading file %s\n", names[i]);
+	fflush(stdout);
+      }
+      ok = 0;
+    }
+  }
+  for (i=0; i<=n; i++) maxdim = (c->dims[i] > maxdim) ? c->dims[i] : maxdim;
+  Z = (acc_t *) malloc(sizeof(acc_t)*(maxdim/g->p+1)*(maxdim/g->q+1));
+
+  if (ok) {
+    MPI_Barrier(g->grid_comm);
+    elapsed = MPI_Wtime();
+    if (c->power > 0) {
+      chain_power(c, Z);
+    } else if (n > 1) {
+      chain_product(c, 0, n-1, Z);
+    } else {
+      grid_set_sizes(g, c->dims[0], c->dims[0], c->dims[1]);
+      for (i=0; i<g->m_local*g->n_local; i++) Z[i] = c->A[0][i];
+    }
+    elapsed = MPI_Wtime()-elapsed;
+    if (rank == 0) {
+      if (c->power > 0)
+	printf("Time for the power %d with %d matrix multiplications %6.1f "
+	       "seconds, %.2f GFLOP/s\n", c->power, c->mults, elapsed,
+	       c->flops/elapsed*1e-9);
+      else
+	printf("Time for the chain of %d matrices with %d matrix "
+	       "multiplications %6.1f seconds, %.2f GFLOP/s\n", n, c->mults,
+	       elapsed, c->flops/elapsed*1e-9);
+      fflush(stdout);
+    }
+
+    if (verify) {
+      seed = (uint64_t) (MPI_Wtime()*1e6);
+      MPI_Bcast(&seed, 1, MPI_UINT64_T, 0, g->grid_comm);
+      t = MPI_Wtime();
+      ratio = chain_check(c, Z, verify, seed);
+      if (rank == 0) {
+	printf("    Freivalds check with %d vectors %s in %.2f seconds, "
+	       "error %.3g of the rounding bound\n", verify,
+	       (ratio <= 1.0) ? "passed" : "FAILED", MPI_Wtime()-t, ratio);
+	fflush(stdout);
+      }
+      ok = (ratio <= 1.0);
+    }
+
+    /* The product is the only thing written */
+    s = mpiio_write_block(Z, fn, g, &g->z);
+    if (rank == 0) {
+      if (s) printf("Result of matrix multiplication written in file %s\n",
+		    fn);
+      else printf("Couldn't write the result to file %s\n", fn);
+      fflush(stdout);
+    }
+    ok = ok && s;
+  }
+
+  for (i=0; i<n; i++) free(c->A[i]);
+  free(c->A);
+  free(c->split);
+  free(Z);
+  return(ok);
+}
+
+/* Prints the message in process 0, unless it is NULL, and quits.
+   Called by all processes */
+static void quit(int id, const char *fmt, ...) {
+  va_list args;
+
+  if (id == 0) {
+    if (fmt != NULL) {
+      va_start(args, fmt);
+      vprintf(fmt, args);
+      va_end(args);
+    }
+    printf("Quitting\n"); fflush(stdout);
+  }
+  MPI_Finalize();
+  exit(1);
+}
+
+/* Checks the modes given on the command line against each other and
+   chooses the grid of nproc processes, dims[0]*dims[1] in each layer.
+   Quits if the modes can't be used together, and turns off with a
+   warning the ones that wouldn't be used. Fox's algorithm runs the
+   first of its variants -sparse, -shm, -compress, -ring and -p that is
+   given. Returns 1 if the grid is square. Called by all processes */
+static int check_modes(int id, int nproc, int *dims) {
+  int run, square_grid;
+
+  /* Fox's, Cannon's and the 2.5D algorithm need a square grid, */
+  /* SUMMA doesn't */
+  square_grid = (replication > 1);
+  for (run=0; run<nruns; run++) {
+    if (runs[run] != SUMMA) square_grid = 1;
+  }
+
+  /* The out-of-core mode does its own I/O and runs on any grid */
+  if (ooc_tile > 0) {
+    if (serial_io || batch)
+      quit(id, "The out-of-core mode (-ooc) can't be used with -s or "
+	   "-batch\n");
+    square_grid = 0;
+    replication = 1;
+  }
+
+  /* So does the LU factorization */
+  if (lu_block > 0) {
+    if (serial_io || batch || ooc_tile > 0)
+      quit(id, "The LU factorization (-lu) can't be used with -s, -batch "
+	   "or -ooc\n");
+    square_grid = 0;
+    replication = 1;
+  }
+
+  /* Powers and chains are multiplied with Fox's algorithm or SUMMA */
+  if (power > 0 || chain_name != NULL) {
+    if (serial_io || batch || ooc_tile > 0 || lu_block > 0 || sparse > 0.0 ||
+	use_shm || compress || replication > 1 || nruns > 1 ||
+	(runs[0] != FOX && runs[0] != SUMMA) || (power > 0 && chain_name))
+      quit(id, "Powers (-power) and chains (-chain) are computed one at a "
+	   "time with one of fox and summa, without -s, -batch, -sparse, "
+	   "-shm, -compress, -ooc and -lu\n");
+#ifdef FOX_INT8
+    quit(id, "The intermediate products of powers (-power) and chains "
+	 "(-chain) don't fit in int8, use another element type\n");
+#endif
+    if (strassen_cutoff > 0) {
+      if (id == 0) {
+	printf("Strassen's algorithm (-S) isn't used for powers and chains, "
+	       "ignoring it\n");
+	fflush(stdout);
+      }
+      strassen_cutoff = 0;
+    }
+  }
+
+  if (square_grid) {
+    /* The process grid will be of size q*q in each of the c layers */
+    dims[0] = dims[1] = (int) sqrt((double) (nproc/replication));
+
+    /* Check that we have a square number of processes */
+    if (dims[0]*dims[0]*replication != nproc) {
+      if (replication > 1)
+	quit(id, "You have to use %d times a square number of processes\n",
+	     replication);
+      quit(id, "You have to use a square number of processes\n");
+    }
+
+    /* The 2.5D algorithm splits the q stages evenly over the layers */
+    if (dims[0]%replication != 0)
+      quit(id, "The number of layers (%d) has to divide the grid size "
+	   "(%d)\n", replication, dims[0]);
+
+    if (serial_io && batch)
+      quit(id, "Batch mode (-batch) uses MPI-IO and can't be used with "
+	   "-s\n");
+
+    if (serial_io && (replication > 1))
+      quit(id, "Serial I/O (-s) can't be used with more than one layer\n");
+  } else {
+    /* Let MPI choose a grid that is as square as possible */
+    dims[0] = dims[1] = 0;
+    MPI_Dims_create(nproc, 2, dims);
+
+    if (serial_io)
+      quit(id, "Serial I/O (-s) needs a square grid, use it with fox or "
+	   "cannon\n");
+
+    /* The local blocks aren't square, so Strassen's algorithm can't be used */
+    if (strassen_cutoff > 0) {
+      if (id == 0) {
+	printf("Strassen's algorithm (-S) needs a square grid, ignoring it\n");
+	fflush(stdout);
+      }
+      strassen_cutoff = 0;
+    }
+  }
+
+#ifndef FLOAT_KERNELS
+  if (strassen_cutoff > 0) {
+    if (id == 0) {
+      printf("Strassen's algorithm (-S) is only available for floats, ignoring it\n");
+      fflush(stdout);
+    }
+    strassen_cutoff = 0;
+  }
+#endif
+
+  if (use_shm) {
+    for (run=0; run<nruns && runs[run] != FOX; run++);
+    if (run == nruns || sparse > 0.0) {
+      if (id == 0) printf("Shared memory (-shm) is only used by Fox's algorithm without -sparse, ignoring it\n");
+      use_shm = 0;
+    }
+  }
+  if (ring > 0 && (sparse > 0.0 || use_shm || compress)) {
+    if (id == 0) printf("The ring broadcast (-ring) isn't used with -sparse, -shm or -compress, ignoring it\n");
+    ring = 0;
+  }
+  if (pipelined && (sparse > 0.0 || use_shm || compress || ring > 0)) {
+    if (id == 0) printf("Overlapping (-p) isn't used with -sparse, -shm, -compress or -ring, ignoring it\n");
+    pipelined = 0;
+  }
+  /* The ring multiplies segments of rows, which aren't square */
+  if (ring > 0 && strassen_cutoff > 0) {
+    for (run=0; run<nruns && runs[run] != FOX; run++);
+    if (run < nruns) {
+      if (id == 0) printf("Strassen's algorithm (-S) isn't used with -ring, ignoring it\n");
+      strassen_cutoff = 0;
+    }
+  }
+  return(square_grid);
+}
+
+/* Checks that the M*K matrix X and the K*N matrix Y, or the matrices
+   of the chain of nchain with sizes dims, can be distributed over the
+   p*q grid and used with the modes given. Turns off Strassen's
+   algorithm for rectangular matrices. Returns 1 if the matrices are
+   rectangular. Called by all processes */
+static int check_sizes(int id, int M, int K, int N, int p, int q,
+		       int square_grid, int nchain, int *dims) {
+  int i, run, rect;
+
+  /* SUMMA needs at least one row and column in every process */
+  if (M < p || K < p || K < q || N < q)
+    quit(id, "The matrix size (%d*%d*%d) is smaller than the process "
+	 "grid\n", M, K, N);
+
+  /* Check that q divides the sizes evenly */
+  if (square_grid && (M%q != 0 || K%q != 0 || N%q != 0)) {
+    if (M == N && K == N)
+      quit(id, "The matrix size (%d) is not evenly divisible by the "
+	   "process grid size (%d)\n", N, q);
+    quit(id, "The matrix sizes (%d*%d*%d) are not evenly divisible by the "
+	 "process grid size (%d)\n", M, K, N, q);
+  }
+
+  if ((lu_block > 0 || power > 0) && M != K)
+    quit(id, "The LU factorization (-lu) and powers (-power) need a square "
+	 "matrix\n");
+
+  /* The inner sizes of a chain have to fit the grid as well */
+  for (i=1; i<nchain; i++) {
+    if (dims[i] < p || dims[i] < q || (square_grid && dims[i]%q != 0))
+      quit(id, "The size %d in the chain is smaller than the process grid "
+	   "or not divisible by its size (%d)\n", dims[i], q);
+  }
+
+  /* Rectangular matrices are multiplied with Fox's algorithm or SUMMA */
+  rect = (M != N || K != N);
+  for (run=0; run<nruns && (runs[run] == FOX || runs[run] == SUMMA); run++);
+  if (rect && (run < nruns || replication > 1 || serial_io || sparse > 0.0 ||
+	       use_shm || compress || ooc_tile > 0))
+    quit(id, "Rectangular matrices can only be multiplied with fox and summa, "
+	 "without -s, -sparse, -shm, -compress and -ooc\n");
+  if (rect && strassen_cutoff > 0) {
+    if (id == 0) {
+      printf("Strassen's algorithm (-S) needs square matrices, ignoring it\n");
+      fflush(stdout);
+    }
+    strassen_cutoff = 0;
+  }
+  return(rect);
+}
+
 int main(int argc, char** argv) {
 
   int verbose = 0;                 /* Verbose flag, produces output */
   int debug = 0;                   /* Debug flag, produces even more output */
   int c, dlimit;
+  int run, square_grid;
+  int ok;
+  int verify = 0;                  /* Nr of vectors in Freivalds' check */
+  uint64_t seed;                   /* Seed for the vectors */
+  char profile[256];               /* Profile with blocking parameters */
+  matrix_tuning_t *tuning;
+  int ntuned;                      /* Nr of processes that loaded it */
+  char *manifest_name = NULL;      /* Jobs of the batch mode */
+  FILE *manifest = NULL;
+  int job = 0, failed = 0;
+  int use_plan = 0;                /* Persistent requests for Fox */
+  fox_plan_t plan;
+  double batch_start;
+  int shm_group = 0;               /* Processes per shared window */
+  shm_t shm;
+  char chain_files[MAX_CHAIN][80];
+  int chain_dims[MAX_CHAIN+1], nchain = 1;
+  chain_t chain;
+  char *stats_file = NULL;         /* File for the stage timings */
+  double elapsed;                  /* Time of the multiplication */
+  double ratio = 0.0;
+  double diff, maxdiff;
+  int provided;                    /* Thread support level given by MPI */
   double start;
 
-  const int datatag = 42;      /* Tag for message passing */
   int nproc, id;               /* Nr of processes and own identifier */
   int i, j, k, l;              /* Loop indexes */
-  int N;                       /* Size of global matrices */
+  int M, K, N;                 /* X is M*K, Y is K*N and Z is M*N */
+  long rows, cols;             /* Size of a matrix in a file header */
+  int sizes[3];
+  int rect;                    /* The matrices aren't square */
   int N_local;                 /* Size of local matrices */
   int startx, starty;          /* Used when distributing/collecting data */
 
-  float *X, *Y, *Z;                    /* Matrices to be multiplied */
-  float *X_local, *Y_local, *Z_local;  /* Local submatrices */
-  float *tmp;                          /* Temporary matrix, used in broadcast */
+  elem_t *X, *Y;                       /* Matrices to be multiplied */
+  acc_t *Z;                            /* Result */
+  int X_mapped = 0, Y_mapped = 0, Z_mapped = 0;  /* Mapped from files */
+  elem_t *X_local, *Y_local;           /* Local submatrices */
+  acc_t *Z_local;
+  elem_t *tmp;                         /* Temporary matrix, used in broadcast */
+  acc_t *Z_first;                      /* Result of the first algorithm */
   char *fn1, *fn2, *fn3;               /* Filenames */
 
+  MPI_Comm cube_comm;               /* All layers of the grid */
   MPI_Comm grid_comm;               /* Topology with grid structure */
   MPI_Comm row_comm, col_comm;      /* Communicators for row and column */
-  int q;                            /* Process grid is of size q*q */
+  MPI_Comm depth_comm;              /* Communicator across the layers */
+  int p, q;                         /* Process grid is of size p*q */
   int my_row, my_col;               /* Row and column number in process grid */
-  int source, dest;       /* Source and destination addresses for circular shift */
+  int dest;                         /* Destination when distributing data */
   int grid_rank;                    /* Process rank in grid */
-  int stage;
-  int dimensions[2], wraparound[2];
-  int coordinates[2], remain[2];
+  grid_t grid;                      /* The above, passed to the algorithm */
+  int dimensions[3], wraparound[3];
+  int coordinates[2], remain[3];
   MPI_Status status;
 
-  /* Initialize MPI, get nr of processes and own id */
-  MPI_Init(&argc, &argv);
+  /* Initialize MPI, get nr of processes and own id. Only the main
+     thread makes MPI calls, the OpenMP threads just compute */
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
   MPI_Comm_size(MPI_COMM_WORLD, &nproc);
   MPI_Comm_rank(MPI_COMM_WORLD, &id);
 
-  /* Parse arguments to see if we have a -v or -d flag */
-  while ((c=getopt(argc, argv, "vd:")) != -1) {
+  matrix_profile_name(profile, sizeof(profile));
+
+  /* Parse the command line flags */
+  while ((c=getopt_long_only(argc, argv, "vd:b:t:psa:c:S:", long_options,
+			     NULL)) != -1) {
     switch (c) {
     case 'v':
       verbose = 1;             /* Set verbose flag */
@@ -66,109 +3152,302 @@ int main(int argc, char** argv) {
       verbose = 1;
       dlimit = atoi(optarg); /* Get the argument to -d  */
       break;
+    case 'b':
+      blocksize = atoi(optarg); /* Use the blocked kernel */
+      break;
+    case 't':
+      nthreads = atoi(optarg);  /* Hybrid MPI+OpenMP mode */
+      break;
+    case 'p':
+      pipelined = 1;            /* Double buffered stages */
+      break;
+    case 's':
+      serial_io = 1;            /* Do all file I/O in process 0 */
+      break;
+    case 'a':
+      nruns = parse_algorithms(optarg, runs);
+      if (nruns == 0)
+	quit(id, "Give at most %d of the algorithms fox, summa, cannon and "
+	     "2.5d\n", MAX_RUNS);
+      break;
+    case 'c':
+      replication = atoi(optarg); /* Nr of layers in the 2.5D algorithm */
+      if (replication < 1) replication = 1;
+      break;
+    case 'S':
+      strassen_cutoff = atoi(optarg); /* Use the Strassen kernel */
+      break;
+    case 'V':
+      /* Check the result with -verify or -verify=k vectors */
+      verify = (optarg != NULL) ? atoi(optarg) : 2;
+      if (verify < 1) verify = 1;
+      break;
+    case 'P':
+      strncpy(profile, optarg, 255); /* Profile, or none */
+      profile[255] = '\0';
+      break;
+    case 'B':
+      manifest_name = optarg;   /* Jobs to do in batch mode */
+      batch = 1;
+      break;
+    case 'T':
+      stats_file = optarg;      /* Record the time of every stage */
+      record_stats = 1;
+      break;
+    case 'Z':
+      /* Sparse blocks with -sparse or -sparse=threshold */
+      sparse = (optarg != NULL) ? atof(optarg) : SPARSE_THRESHOLD;
+      break;
+    case 'M':
+      /* Shared memory windows with -shm or -shm=group */
+      use_shm = 1;
+      shm_group = (optarg != NULL) ? atoi(optarg) : 0;
+      break;
+    case 'K':
+      compress = 1;             /* Compress the blocks of Fox */
+      break;
+    case 'R':
+      /* Ring broadcast with -ring or -ring=segments */
+      ring = (optarg != NULL) ? atoi(optarg) : RING_SEGMENTS;
+      if (ring <= 0) ring = RING_SEGMENTS;
+      break;
+    case 'L':
+      /* LU factorization with -lu or -lu=blocksize */
+      lu_block = (optarg != NULL) ? atoi(optarg) : LU_BLOCK;
+      if (lu_block <= 0) lu_block = LU_BLOCK;
+      break;
+    case 'W':
+      power = atoi(optarg);     /* Compute X^power */
+      if (power < 1) power = 1;
+      break;
+    case 'C':
+      chain_name = optarg;      /* Multiply a chain of matrices */
+      break;
+    case 'O':
+      /* Out of core with -ooc or -ooc=tile */
+      ooc_tile = (optarg != NULL) ? atoi(optarg) : OOC_TILE;
+      if (ooc_tile <= 0) ooc_tile = OOC_TILE;
+      break;
     }
   }
 
-  /* The process grid will be of size q*q */
-  q = (int) sqrt((double) nproc);
+  /* Load the blocking parameters tuned for the host of this process, */
+  /* which may differ between the nodes */
+  if (strcmp(profile, "none") != 0) tuned = (matrix_tuning_load(profile) > 0);
+#ifdef FLOAT_KERNELS
+  tuning = &matrix_tuning;
+#else
+  tuning = &matrix_tuning_d;
+#endif
+  MPI_Reduce(&tuned, &ntuned, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
 
-  /* Check that we have a square number of processes */
-  if (q*q != nproc) {
+  if (nthreads > 0) {
+#ifdef _OPENMP
+    omp_set_num_threads(nthreads);
+#else
     if (id == 0) {
-      printf("You have to use a square number of processes\n");
-      printf("Quitting\n"); fflush(stdout);
+      printf("Compiled without OpenMP, ignoring -t %d\n", nthreads);
+      fflush(stdout);
+    }
+#endif
+    if (provided < MPI_THREAD_FUNNELED && id == 0) {
+      printf("Warning: MPI library doesn't support MPI_THREAD_FUNNELED\n");
+      fflush(stdout);
     }
-    MPI_Finalize();
-    exit(1);
   }
 
+  /* Check the modes against each other and choose the grid */
+  square_grid = check_modes(id, nproc, dimensions);
+  p = dimensions[0];
+  q = dimensions[1];
+
   if (verbose && (id == 0)) {
-    printf("Using a process grid of size %d*%d\n", q,q);
+    printf("Element type %s\n", ELEM_NAME);
+    if (replication > 1)
+      printf("Using a process grid of size %d*%d*%d\n", p, q, replication);
+    else
+      printf("Using a process grid of size %d*%d\n", p, q);
+    if (blocksize > 0)
+      printf("Using blocked local multiplication, block size %d\n", blocksize);
+    else if (tuned)
+      printf("Using blocked local multiplication, mc %d kc %d nc %d from %s\n",
+	     tuning->mc, tuning->kc, tuning->nc, profile);
+    if (ntuned > 0 && ntuned < nproc)
+      printf("Tuning profile found in only %d of %d processes\n", ntuned,
+	     nproc);
+    if (nthreads > 0)
+      printf("Using %d threads per process\n", nthreads);
+    if (strassen_cutoff > 0)
+      printf("Using Strassen-Winograd local multiplication, cutoff %d\n",
+	     strassen_cutoff);
+    if (pipelined)
+      printf("Overlapping communication with computation\n");
+    if (sparse > 0.0)
+      printf("Using sparse blocks in Fox's algorithm up to density %g\n",
+	     sparse);
+    if (compress)
+      printf("Compressing the blocks of Fox's algorithm\n");
+    if (ring > 0)
+      printf("Broadcasting along a ring in %d segments\n", ring);
+    if (ooc_tile > 0)
+      printf("Multiplying out of core, the algorithm (-a) is not used\n");
+    if (lu_block > 0)
+      printf("Factoring X with blocked LU, block size %d, the algorithm (-a) "
+	     "is not used\n", lu_block);
+    if (power > 0)
+      printf("Computing the power %d of X, Y is not used\n", power);
+    if (chain_name != NULL)
+      printf("Multiplying the chain of matrices in %s\n", chain_name);
     fflush(stdout);
   }
 
-  /* Process 0 allocates space for filenames, reads the size of matrices */
-  /* and reads the filenames */
-  if (id == 0) {
-    /* Allocate space for filenames */
-    fn1 = (char *) malloc(sizeof(char)*80);
-    fn2 = (char *) malloc(sizeof(char)*80);
-    fn3 = (char *) malloc(sizeof(char)*80);
-    
-    printf("Give size of matrices:\n "); fflush(stdout);
-    scanf("%d",&N);
-
-    printf("Give names of two files with matrices to multiply: \n"); fflush(stdout);
-    scanf("%s%s", fn1,fn2);
+  /* Allocate space for filenames */
+  fn1 = (char *) malloc(sizeof(char)*80);
+  fn2 = (char *) malloc(sizeof(char)*80);
+  fn3 = (char *) malloc(sizeof(char)*80);
+
+  /* In batch mode the filenames are those of the first job and */
+  /* the size is read from the header of its first matrix */
+  if (batch) {
+    if (id == 0 && (manifest=fopen(manifest_name, "r")) == NULL)
+      printf("Couldn't open the manifest %s\n", manifest_name);
+    if (!next_job(manifest, fn1, fn2, fn3, id))
+      quit(id, "No jobs in the manifest %s\n", manifest_name);
+    N = 0;
+  }
+  /* Otherwise process 0 reads the size of matrices and the filenames */
+  else if (id == 0) {
+    /* The matrices of a chain are listed in its file */
+    if (chain_name == NULL) {
+      printf("Give size of matrices:\n "); fflush(stdout);
+      scanf("%d",&N);
+
+      printf("Give names of two files with matrices to multiply: \n"); fflush(stdout);
+      scanf("%s%s", fn1,fn2);
+    } else {
+      fn1[0] = fn2[0] = '\0';
+    }
     printf("Give name of output file: \n"); fflush(stdout);
     scanf("%s", fn3);
     printf("\n"); fflush(stdout);
   }
 
-  /* Broadcast the matrix size N to all processes */
-  MPI_Bcast(&N, 1, MPI_INT, 0, MPI_COMM_WORLD);
-  if (verbose && (id == 0)) {
-    printf("Broadcasted matrix size %d to all processes\n",N);
+  /* The sizes of X and Y are taken from the headers of the files, so */
+  /* they may be rectangular. The size given is that of old files    */
+  /* without a header, which hold square matrices                    */
+  /* For a chain they are those of the product of its first two    */
+  /* matrices and its last one                                      */
+  if (id == 0 && chain_name != NULL) {
+    nchain = read_chain(chain_name, chain_files, chain_dims);
+    sizes[0] = sizes[1] = sizes[2] = 0;
+    if (nchain > 0) {
+      sizes[0] = chain_dims[0];
+      sizes[1] = chain_dims[1];
+      sizes[2] = chain_dims[nchain];
+    }
+  } else if (id == 0) {
+    M = K = N;
+    if (matrix_shape(fn1, &rows, &cols)) {
+      M = (int) rows;
+      K = (int) cols;
+    }
+    if (lu_block > 0 || power > 0) {
+      N = K;                    /* Y isn't used */
+    } else if (matrix_shape(fn2, &rows, &cols)) {
+      if (rows != K) {
+	printf("The matrix in %s has %ld rows, the one in %s has %d columns\n",
+	       fn2, rows, fn1, K);
+	K = 0;
+      }
+      N = (int) cols;
+    }
+    if (M <= 0 || N <= 0)
+      printf("Couldn't get the size of the matrices from %s and %s\n", fn1,
+	     fn2);
+    sizes[0] = M; sizes[1] = K; sizes[2] = N;
+  }
+
+  /* Broadcast the matrix sizes to all processes */
+  MPI_Bcast(sizes, 3, MPI_INT, 0, MPI_COMM_WORLD);
+  M = sizes[0]; K = sizes[1]; N = sizes[2];
+  if (M <= 0 || K <= 0 || N <= 0) quit(id, NULL);
+  if (verbose && (id == 0) && chain_name == NULL) {
+    printf("Broadcasted matrix sizes %d*%d and %d*%d to all processes\n", M,
+	   K, K, N);
     fflush(stdout);
   }
+  /* All processes need the filenames for MPI-IO */
+  MPI_Bcast(fn1, 80, MPI_CHAR, 0, MPI_COMM_WORLD);
+  MPI_Bcast(fn2, 80, MPI_CHAR, 0, MPI_COMM_WORLD);
+  MPI_Bcast(fn3, 80, MPI_CHAR, 0, MPI_COMM_WORLD);
+  if (chain_name != NULL) {
+    MPI_Bcast(&nchain, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(chain_dims, nchain+1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(chain_files, 80*nchain, MPI_CHAR, 0, MPI_COMM_WORLD);
+  }
   /* Calculate size of the local matrices in each process */
   N_local = N/q;
 
-  /* Check that q divides N evenly */
-  if (N_local*q != N) {
-    if (id == 0) {
-      printf("The matrix size (%d) is not evenly divisible ", N);
-      printf("by the process grid size (%d)\n", q);
-      printf("Quitting\n"); fflush(stdout);
-    }
-    MPI_Finalize();
-    exit(1);
-  }
+  /* Check the sizes against the grid and the modes */
+  rect = check_sizes(id, M, K, N, p, q, square_grid, nchain, chain_dims);
 
-  /* Process zero allocates space for matrices and reads them from the files */
-  if (id == 0) {
-    if (verbose) {
+  if (verbose && (id == 0) && square_grid && chain_name == NULL) {
+    if (rect)
+      printf("Local matrix sizes are %d*%d and %d*%d\n", M/q, K/q, K/q, N/q);
+    else
       printf("Local matrix size is %d\n", N_local);
-      fflush(stdout);
-    }
-
-    /* Allocate space for matrices */
-    X = (float *) malloc(sizeof(float)*N*N);
-    Y = (float *) malloc(sizeof(float)*N*N);
-    Z = (float *) malloc(sizeof(float)*N*N);
+    fflush(stdout);
+  }
 
-    /* Read the input matrices from the files */
-    if (!fread_matrix(X, N*N, fn1)) {
+  /* With serial I/O process zero allocates space for matrices and */
+  /* reads them from the files */
+  X = Y = NULL;
+  Z = NULL;
+  if (serial_io && (id == 0)) {
+    /* Map the input matrices from the files, or read them if they */
+    /* are not stored row by row. The result is written straight */
+    /* into the mapped output file */
+    if ((X=map_input(fn1, N, &X_mapped)) == NULL) {
       printf("error in reading file %s\n", fn1); fflush(stdout);
       exit(1); /* Should also terminate other processes */
     }
-    if (!fread_matrix(Y, N*N, fn2)) {
+    if ((Y=map_input(fn2, N, &Y_mapped)) == NULL) {
       printf("error in reading file %s\n", fn2); fflush(stdout);
       exit(1);
     }
+    if ((Z=matrix_create(fn3, MATRIX_TYPE_OF(Z), N, N, MATRIX_ROWMAJOR, 0))
+	!= NULL) Z_mapped = 1;
+    else Z = (acc_t *) malloc(sizeof(acc_t)*N*N);
   }
 
   /* Print part of the matrix if debug is on */
-  if (debug && (id == 0)) {
+  if (debug && (X != NULL)) {
     int limit;
     limit = min(dlimit, N);
     printf("The %d*%d first entries in the matrix X is\n", limit,limit);
     fflush(stdout);
-    write_matrix(X, limit);
+    write_matrix_t(X, limit);
   }
 
-  /* Allocate space for the local matrices */
-  X_local = (float *) malloc(sizeof(float)*N_local*N_local);
-  Y_local = (float *) malloc(sizeof(float)*N_local*N_local);
-  Z_local = (float *) malloc(sizeof(float)*N_local*N_local);
+  /* Nr of processes per dimension. The third dimension holds the */
+  /* layers of the 2.5D algorithm, and is 1 for the others         */
+  dimensions[0] = p;
+  dimensions[1] = q;
+  dimensions[2] = replication;
+  /* Make it cyclic in both grid dimensions, Cannon's algorithm */
+  /* shifts the blocks around both the rows and the columns     */
+  wraparound[0] = 1; wraparound[1] = 1; wraparound[2] = 0;
+
+  /* Create the layers of process grids in the topology cube_comm */
+  MPI_Cart_create(MPI_COMM_WORLD, 3, dimensions, wraparound, 0, &cube_comm);
 
-  /* Nr of processes per dimension */
-  dimensions[0] = dimensions[1] = q;
-  /* Make it cyclic in second dimension (columns will wrap around) */
-  wraparound[0] = 0; wraparound[1] = 1;
+  /* Create the process grid of each layer in grid_comm */
+  remain[0] = 1; remain[1] = 1; remain[2] = 0;
+  MPI_Cart_sub(cube_comm, remain, &grid_comm);
 
-  /* Create the process grid in the topology grid_comm */
-  MPI_Cart_create(MPI_COMM_WORLD, 2, dimensions, wraparound, 0, &grid_comm);
+  /* Create communicators across the layers */
+  remain[0] = 0; remain[1] = 0; remain[2] = 1;
+  MPI_Cart_sub(cube_comm, remain, &depth_comm);
 
   /* Get own rank in the grid communicator */
   MPI_Comm_rank(grid_comm, &grid_rank);
@@ -186,188 +3465,471 @@ int main(int argc, char** argv) {
   remain[0] = 1; remain[1] = 0;
   MPI_Cart_sub(grid_comm, remain, &col_comm);
 
-  if (verbose && (id == 0)) {
-    printf("Process 0 distributing data to all processes\n");
-    fflush(stdout);
-  }
+  grid.grid_comm = grid_comm;
+  grid.row_comm = row_comm;
+  grid.col_comm = col_comm;
+  grid.depth_comm = depth_comm;
+  grid.p = p;
+  grid.q = q;
+  grid.c = replication;
+  MPI_Comm_rank(depth_comm, &grid.my_layer);
+  grid.my_row = my_row;
+  grid.my_col = my_col;
+  /* Source and destination addresses for the circular shift */
+  grid.dest = (my_row+q-1)%q;
+  grid.source = (my_row+1)%q;
 
-  /* Distribute matrices X and Y on the process grid */
-  if (grid_rank == 0) {
-    /* Process zero sends submatrices to all other processes */
-    for (i=q-1; i>=0; i--) {
-      for (j=q-1; j>=0; j--) {  /* For all processes in the 2-D grid */
-	startx = i*N_local;     /* Index to the global matrix where */
-	starty = j*N_local;     /* the submatrix of this process starts */
-	/* Copy submatrices to the local matrices */
-	for (k=0; k<N_local; k++) {
-	  for (l=0; l<N_local; l++) {
-	    X_local[k*N_local+l] = X[(startx+k)*N+(starty+l)];
-	    Y_local[k*N_local+l] = Y[(startx+k)*N+(starty+l)];
-	  }
-	}
-	/* Find destination address for the submatrices */
-	coordinates[0] = i; coordinates[1] = j;
-	MPI_Cart_rank(grid_comm, coordinates, &dest);
-
-	/* Don't send to your self ! */
-	if (dest != 0) {
-	  if (verbose) {
-	    printf("    sending to process %d\n", dest);
-	    fflush(stdout);
-	  }
-	  MPI_Send(X_local, N_local*N_local, MPI_FLOAT, dest, datatag, 
-		   grid_comm);
-	  MPI_Send(Y_local, N_local*N_local, MPI_FLOAT, dest, datatag, 
-		   grid_comm);
-	}
-      }
+  /* Find the part of the matrices stored in this process. On a square
+     grid all blocks of square matrices are of size N_local*N_local */
+  grid_set_sizes(&grid, M, K, N);
+
+  /* The out-of-core mode streams the tiles from the files and */
+  /* keeps no blocks of the matrices in memory */
+  if (ooc_tile > 0) {
+    MPI_Barrier(MPI_COMM_WORLD);
+    start = MPI_Wtime();
+    ok = ooc_multiply(&grid, fn1, fn2, fn3, ooc_tile, verbose && (id == 0));
+    if (id == 0) {
+      printf("Time for out-of-core matrix multiplication %6.1f seconds\n",
+	     MPI_Wtime()-start);
+      if (ok) printf("Result of matrix multiplication written in file %s\n",
+		     fn3);
+      else printf("Couldn't multiply the matrices in files %s and %s into %s\n",
+		  fn1, fn2, fn3);
+      fflush(stdout);
     }
-  }
-  /* All other processes receive the submatrices */
-  else {
-    MPI_Recv(X_local, N_local*N_local, MPI_FLOAT, 0, datatag, grid_comm,
-	     &status);
-    MPI_Recv(Y_local, N_local*N_local, MPI_FLOAT, 0, datatag, grid_comm,
-	     &status);
+    free(fn1);
+    free(fn2);
+    free(fn3);
+    MPI_Comm_free(&cube_comm);
+    MPI_Comm_free(&depth_comm);
+    MPI_Comm_free(&grid_comm);
+    MPI_Comm_free(&row_comm);
+    MPI_Comm_free(&col_comm);
+    MPI_Finalize();
+    exit(ok ? 0 : 1);
   }
 
-  /* Synchronize all processes before we proceed */
-  MPI_Barrier(grid_comm);
+  /* The LU factorization reads X in its own layout and factors it */
+  if (lu_block > 0) {
+    ok = lu_run(&grid, fn1, N, lu_block, verify, verbose && (id == 0));
+    free(fn1);
+    free(fn2);
+    free(fn3);
+    MPI_Comm_free(&cube_comm);
+    MPI_Comm_free(&depth_comm);
+    MPI_Comm_free(&grid_comm);
+    MPI_Comm_free(&row_comm);
+    MPI_Comm_free(&col_comm);
+    MPI_Finalize();
+    exit(ok ? 0 : 1);
+  }
 
-  /* Print the local matrix in process 0 if debug flag is on */
-  if (debug && (id == 0)) {
-    int limit;
-    limit = min(dlimit, N_local);
-    printf("\nThe %d*%d first entries in the local matrix X in process 0 is\n",
-	   limit, limit);
-    fflush(stdout);
-    write_matrix(X_local, limit);
+  /* Powers and chains keep all their operands and intermediate */
+  /* products in the grid, and only write the final product      */
+  if (power > 0 || chain_name != NULL) {
+    if (power > 0) {
+      chain_dims[0] = chain_dims[1] = N;
+      strcpy(chain_files[0], fn1);
+    }
+    chain.g = &grid;
+    chain.n = nchain;
+    chain.power = power;
+    chain.dims = chain_dims;
+    chain.alg = runs[0];
+    chain.pipelined = pipelined;
+    chain.ring = ring;
+    chain.verbose = verbose && (id == 0);
+    ok = chain_run(&chain, chain_files, fn3, verify);
+    free(fn1);
+    free(fn2);
+    free(fn3);
+    MPI_Comm_free(&cube_comm);
+    MPI_Comm_free(&depth_comm);
+    MPI_Comm_free(&grid_comm);
+    MPI_Comm_free(&row_comm);
+    MPI_Comm_free(&col_comm);
+    MPI_Finalize();
+    exit(ok ? 0 : 1);
   }
 
-  /* Do the matrix multiplication algorithm */
+  /* Allocate space for the local matrices, in the shared window */
+  /* if Fox's algorithm reads them from there */
+  if (use_shm) {
+    shm_init(&shm, &grid, N_local, shm_group);
+    X_local = shm.X;
+    Y_local = shm.Y;
+  } else {
+    X_local = (elem_t *) malloc(sizeof(elem_t)*grid.x.m*grid.x.n);
+    Y_local = (elem_t *) malloc(sizeof(elem_t)*grid.y.m*grid.y.n);
+  }
+  Z_local = (acc_t *) malloc(sizeof(acc_t)*grid.m_local*grid.n_local);
 
   if (verbose && (id == 0)) {
-    printf("Starting matrix multiplication\n");
+    if (serial_io) printf("Process 0 distributing data to all processes\n");
+    else printf("All processes reading their blocks with MPI-IO\n");
     fflush(stdout);
   }
 
-  /* Calculate source and destination addresses for the circular shift */
-  dest = (my_row+q-1)%q;
-  source = (my_row+1)%q;
-
   /* Allocate storage for temporary local matrix */
-  tmp = (float *) malloc(sizeof(float)*N_local*N_local);
+  tmp = (elem_t *) malloc(sizeof(elem_t)*grid.x.m*grid.x.n);
+  Z_first = (acc_t *) malloc(sizeof(acc_t)*grid.m_local*grid.n_local);
 
-  start = MPI_Wtime();
-  /* Set the matrix Z_local to zero */
-  settozero(Z_local, N_local);
+  /* The workspace for Strassen's algorithm is allocated once per run */
+  if (strassen_cutoff > 0) {
+    strassen_work = (float *) malloc(sizeof(float)*
+				     strassen_worksize(N_local, strassen_cutoff));
+  }
 
-  for (stage=0; stage<q; stage++) {
-    int bcast_root;
-    if (verbose && (id == 0)) {
-      printf("    stage %d\n", stage);
+  /* In batch mode Fox's algorithm uses persistent requests, which */
+  /* are set up once for all the jobs */
+  for (run=0; run<nruns; run++) {
+    if (batch && runs[run] == FOX && sparse == 0.0 && !use_shm && !compress &&
+	ring == 0 && !rect)
+      use_plan = 1;
+  }
+  if (use_plan && pipelined) {
+    if (id == 0) {
+      printf("Batch mode overlaps the stages of Fox's algorithm with "
+	     "persistent requests, ignoring -p\n");
       fflush(stdout);
     }
+    pipelined = 0;
+  }
+  if (use_plan) fox_plan_init(&plan, &grid, X_local, Y_local, N_local);
 
-    /* The process bcast_root does the broadcast in each stage */
-    bcast_root = (my_row+stage)%q;
-    if (bcast_root == my_col) {
-      MPI_Bcast(X_local, N_local*N_local, MPI_FLOAT, bcast_root, row_comm);
-      matrixmult(X_local, Y_local, Z_local, N_local);
-    } else {
-      MPI_Bcast(tmp, N_local*N_local, MPI_FLOAT, bcast_root, row_comm);
-      matrixmult(tmp, Y_local, Z_local, N_local);
+  /* Do the jobs, which is just one unless in batch mode */
+  batch_start = MPI_Wtime();
+  do {
+    if (batch && (id == 0)) {
+      printf("Job %d: %s * %s -> %s\n", ++job, fn1, fn2, fn3);
+      fflush(stdout);
     }
-    MPI_Sendrecv_replace(Y_local, N_local*N_local, MPI_FLOAT, dest, datatag, 
-			 source, datatag, col_comm, &status);
-  }
 
-  if (id == 0) {
-    printf("Time for matrix multiplication %6.1f seconds\n\n", 
-		      MPI_Wtime()-start);
-    fflush(stdout);
-  }
+    /* Every process in layer 0 reads its own blocks of X and Y from */
+    /* the files */
+    if (!serial_io) {
+      ok = 1;
+      if (grid.my_layer == 0) {
+	ok = mpiio_read_block(X_local, fn1, &grid, &grid.x) &&
+	  mpiio_read_block(Y_local, fn2, &grid, &grid.y);
+      }
+      MPI_Bcast(&ok, 1, MPI_INT, 0, depth_comm);
+      if (!ok) {
+	if (id == 0) {
+	  printf("error in reading files %s and %s\n", fn1, fn2);
+	  fflush(stdout);
+	}
+	if (batch) {
+	  failed++;
+	  continue;
+	}
+	MPI_Finalize();
+	exit(1);
+      }
+    }
+    /* Distribute matrices X and Y on the process grid */
+    else if (grid_rank == 0) {
+      /* Process zero sends submatrices to all other processes */
+      for (i=q-1; i>=0; i--) {
+	for (j=q-1; j>=0; j--) {  /* For all processes in the 2-D grid */
+	  startx = i*N_local;     /* Index to the global matrix where */
+	  starty = j*N_local;     /* the submatrix of this process starts */
+	  /* Copy submatrices to the local matrices */
+	  for (k=0; k<N_local; k++) {
+	    for (l=0; l<N_local; l++) {
+	      X_local[k*N_local+l] = X[(startx+k)*N+(starty+l)];
+	      Y_local[k*N_local+l] = Y[(startx+k)*N+(starty+l)];
+	    }
+	  }
+	  /* Find destination address for the submatrices */
+	  coordinates[0] = i; coordinates[1] = j;
+	  MPI_Cart_rank(grid_comm, coordinates, &dest);
 
-  if (verbose && (id == 0)) {
-    printf("Matrix multiplication done, collecting results\n");
-    fflush(stdout);
-  }
+	  /* Don't send to your self ! */
+	  if (dest != 0) {
+	    if (verbose) {
+	      printf("    sending to process %d\n", dest);
+	      fflush(stdout);
+	    }
+	    MPI_Send(X_local, N_local*N_local, MPI_ELEM, dest, datatag, 
+		     grid_comm);
+	    MPI_Send(Y_local, N_local*N_local, MPI_ELEM, dest, datatag, 
+		     grid_comm);
+	  }
+	}
+      }
+    }
+    /* All other processes receive the submatrices */
+    else {
+      MPI_Recv(X_local, N_local*N_local, MPI_ELEM, 0, datatag, grid_comm,
+	       &status);
+      MPI_Recv(Y_local, N_local*N_local, MPI_ELEM, 0, datatag, grid_comm,
+	       &status);
+    }
+
+    /* Synchronize all processes before we proceed */
+    MPI_Barrier(grid_comm);
 
-  /* Copy the local result in process 0 to the global result in Z */
-  if (grid_rank == 0) {
-    /* Copy the result from process 0 into the global matrix Z */
-    for (k=0; k<N_local; k++) {
-      for (l=0; l<N_local; l++) Z[k*N+l] = Z_local[k*N_local+l];
+    /* Print the local matrix in process 0 if debug flag is on */
+    if (debug && (id == 0)) {
+      int limit;
+      limit = min(dlimit, N_local);
+      printf("\nThe %d*%d first entries in the local matrix X in process 0 is\n",
+	     limit, limit);
+      fflush(stdout);
+      write_matrix_t(X_local, limit);
     }
-  }
 
-  /* Collect the result from the local matrices into a global matrix */
-  if (grid_rank == 0) {
-    /* Process zero receives the local matrices */
-    for (i=1; i<nproc; i++) {    
-      MPI_Recv(X_local, N_local*N_local, MPI_FLOAT, i, datatag, grid_comm,
-	       &status);
-      if (debug) {
-	int limit;
-	limit = min(dlimit, N_local);
-	printf("\nThe %d*%d first entries in the result from process %d is\n",
-	       limit,limit, i);
+    /* Do the matrix multiplication with each of the selected algorithms. */
+    /* All of them leave X_local and Y_local as they were, so the runs    */
+    /* multiply the same data and the last one gives the result.          */
+    /* Only the 2.5D algorithm uses the layers above layer 0.             */
+    for (run=0; run<nruns; run++) {
+      if (verbose && (id == 0)) {
+	printf("Starting matrix multiplication with %s\n",
+	       algorithm_names[runs[run]]);
+	fflush(stdout);
+      }
+
+      stats_reset();
+      MPI_Barrier(MPI_COMM_WORLD);
+      start = MPI_Wtime();
+
+      if (grid.my_layer == 0 || runs[run] == TWO_HALF_D) switch (runs[run]) {
+      case TWO_HALF_D:
+	memset(Z_local, 0, sizeof(acc_t)*grid.m_local*grid.n_local);
+	mult_2_5d(&grid, X_local, Y_local, Z_local, N_local,
+		  verbose && (id == 0));
+	break;
+      case SUMMA:
+	memset(Z_local, 0, sizeof(acc_t)*grid.m_local*grid.n_local);
+	summa(&grid, X_local, Y_local, Z_local, verbose && (id == 0));
+	break;
+      case CANNON:
+	memset(Z_local, 0, sizeof(acc_t)*grid.m_local*grid.n_local);
+	cannon(&grid, X_local, Y_local, Z_local, N_local, verbose && (id == 0));
+	break;
+      default:
+	/* Set the matrix Z_local to zero */
+	memset(Z_local, 0, sizeof(acc_t)*grid.m_local*grid.n_local);
+
+	if (sparse > 0.0)
+	  fox_stages_sparse(&grid, X_local, Y_local, Z_local, N_local, sparse,
+			    verbose && (id == 0));
+	else if (use_shm)
+	  fox_stages_shm(&shm, &grid, Z_local, N_local, verbose && (id == 0));
+	else if (compress)
+	  fox_stages_compressed(&grid, X_local, Y_local, Z_local, tmp, N_local,
+				verbose && (id == 0));
+	else if (ring > 0)
+	  fox_stages_ring(&grid, X_local, Y_local, Z_local, tmp, ring,
+			  verbose && (id == 0));
+	else if (use_plan)
+	  fox_stages_persistent(&plan, &grid, Z_local, N_local,
+				verbose && (id == 0));
+	else if (pipelined)
+	  fox_stages_pipelined(&grid, X_local, Y_local, Z_local,
+			       verbose && (id == 0));
+	else
+	  fox_stages(&grid, X_local, Y_local, Z_local, tmp,
+		     verbose && (id == 0));
+      }
+
+      elapsed = MPI_Wtime()-start;
+      if (id == 0) {
+	if (nruns > 1)
+	  printf("Time for matrix multiplication with %-6s %6.1f seconds\n",
+		 algorithm_names[runs[run]], elapsed);
+	else
+	  printf("Time for matrix multiplication %6.1f seconds\n\n",
+		 elapsed);
 	fflush(stdout);
-	write_matrix(X_local, limit);
       }
+      if (record_stats)
+	write_stats(&grid, stats_file, algorithm_names[runs[run]], elapsed);
 
-      /* Get the coordinates of process i */
-      MPI_Cart_coords(grid_comm, i, 2, coordinates);
-      /* Calculate index where to place the local matrix in the global result */
-      startx = coordinates[0]*N_local;
-      starty = coordinates[1]*N_local;
+      /* Check the result with Freivalds' algorithm, with new vectors */
+      /* for every run */
+      if (verify) {
+	seed = (uint64_t) (MPI_Wtime()*1e6)+run;
+	MPI_Bcast(&seed, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+	start = MPI_Wtime();
+	if (grid.my_layer == 0)
+	  ratio = freivalds(&grid, X_local, Y_local, Z_local, verify, seed);
+	if (id == 0) {
+	  printf("    Freivalds check with %d vectors %s in %.2f seconds, "
+		 "error %.3g of the rounding bound\n", verify,
+		 (ratio <= 1.0) ? "passed" : "FAILED", MPI_Wtime()-start, ratio);
+	  printf("    an exact-arithmetic mismatch is missed with probability at "
+		 "most 2^-24 per vector; errors below the rounding bound are "
+		 "accepted by design\n\n");
+	  fflush(stdout);
+	}
+      }
+
+      /* Check the result against the one from the first algorithm */
+      if (nruns > 1) {
+	diff = 0.0;
+	if (grid.my_layer == 0) {
+	  for (i=0; i<grid.m_local*grid.n_local; i++) {
+	    if (run == 0) Z_first[i] = Z_local[i];
+	    else diff = fmax(diff, fabs(Z_local[i]-Z_first[i]));
+	  }
+	}
+	MPI_Reduce(&diff, &maxdiff, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+	if (id == 0) {
+	  if (run > 0)
+	    printf("    max difference to the result of %s is %g\n",
+		   algorithm_names[runs[0]], maxdiff);
+	  if (run == nruns-1) printf("\n");
+	  fflush(stdout);
+	}
+      }
+    }
+
+#ifdef FLOAT_KERNELS
+    /* Compare Strassen's algorithm with the blocked kernel on the local */
+    /* blocks, reporting the largest error relative to the largest entry */
+    if (strassen_cutoff > 0) {
+      double err[2], maxerr[2];       /* Max error and max entry */
+      float *Z_strassen = (float *) calloc(N_local*N_local, sizeof(float));
+      float *Z_classic = (float *) calloc(N_local*N_local, sizeof(float));
+      matrixmult_strassen(X_local, Y_local, Z_strassen, N_local,
+			  strassen_cutoff, blocksize, strassen_work);
+      matrixmult_block(X_local, Y_local, Z_classic, N_local, blocksize);
+      err[0] = err[1] = 0.0;
+      for (i=0; i<N_local*N_local; i++) {
+	err[0] = fmax(err[0], fabs(Z_strassen[i]-Z_classic[i]));
+	err[1] = fmax(err[1], fabs(Z_classic[i]));
+      }
+      MPI_Reduce(err, maxerr, 2, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+      if (id == 0) {
+	printf("Strassen-Winograd max error %g, relative to blocked kernel %g\n\n",
+	       maxerr[0], (maxerr[1] > 0.0) ? maxerr[0]/maxerr[1] : 0.0);
+	fflush(stdout);
+      }
+      free(Z_strassen);
+      free(Z_classic);
+    }
+#endif
+
+    if (verbose && (id == 0)) {
+      if (serial_io) printf("Matrix multiplication done, collecting results\n");
+      else printf("Matrix multiplication done, writing results with MPI-IO\n");
+      fflush(stdout);
+    }
 
-      /* Copy the result from process i into the global matrix Z */
+    /* Copy the local result in process 0 to the global result in Z */
+    if (serial_io && (grid_rank == 0)) {
+      /* Copy the result from process 0 into the global matrix Z */
       for (k=0; k<N_local; k++) {
-	for (l=0; l<N_local; l++) {
-	  Z[(startx+k)*N+(starty+l)] = X_local[k*N_local+l];
+	for (l=0; l<N_local; l++) Z[k*N+l] = Z_local[k*N_local+l];
+      }
+    }
+
+    /* Every process in layer 0 writes its own block of the result to */
+    /* the file */
+    if (!serial_io) {
+      if (grid.my_layer == 0) {
+	ok = mpiio_write_block(Z_local, fn3, &grid, &grid.z);
+	if (ok && (id == 0)) {
+	  printf("Result of matrix multiplication written in file %s\n", fn3);
+	  fflush(stdout);
+	} else if (id == 0) {
+	  printf("Couldn't write the result to file %s\n", fn3);
+	  fflush(stdout);
 	}
+	if (!ok) failed++;
       }
     }
+    /* Collect the result from the local matrices into a global matrix */
+    else if (grid_rank == 0) {
+      /* Process zero receives the local matrices into Z_first, which */
+      /* is no longer needed */
+      for (i=1; i<nproc; i++) {    
+	MPI_Recv(Z_first, N_local*N_local, MPI_ACC, i, datatag, grid_comm,
+		 &status);
+	if (debug) {
+	  int limit;
+	  limit = min(dlimit, N_local);
+	  printf("\nThe %d*%d first entries in the result from process %d is\n",
+		 limit,limit, i);
+	  fflush(stdout);
+	  write_matrix_t(Z_first, limit);
+	}
 
-    /* All other processes send their local matrices to process 0 */
-  } else {
-    MPI_Send(Z_local, N_local*N_local, MPI_FLOAT, 0, datatag, grid_comm);
-  }
+	/* Get the coordinates of process i */
+	MPI_Cart_coords(grid_comm, i, 2, coordinates);
+	/* Calculate index where to place the local matrix in the global result */
+	startx = coordinates[0]*N_local;
+	starty = coordinates[1]*N_local;
 
+	/* Copy the result from process i into the global matrix Z */
+	for (k=0; k<N_local; k++) {
+	  for (l=0; l<N_local; l++) {
+	    Z[(startx+k)*N+(starty+l)] = Z_first[k*N_local+l];
+	  }
+	}
+      }
 
-  /* Print the result of the matrix multiplication */
-  if (debug && (id == 0)) {
-    int limit;
-    limit = min(dlimit, N);
-    printf("The %d*%d first entries in the result matrix is\n", limit,limit);
-    write_matrix(Z, limit);
-    printf ("\n");
-    fflush(stdout);
-  }
+      /* All other processes send their local matrices to process 0 */
+    } else {
+      MPI_Send(Z_local, N_local*N_local, MPI_ACC, 0, datatag, grid_comm);
+    }
 
-  /* Write the result to a file */
-  if (id == 0) {
-    if (fwrite_matrix(Z, N, fn3)) {
-      printf("Result of matrix multiplication written in file %s\n", fn3);
+
+    /* Print the result of the matrix multiplication */
+    if (debug && (Z != NULL)) {
+      int limit;
+      limit = min(dlimit, N);
+      printf("The %d*%d first entries in the result matrix is\n", limit,limit);
+      write_matrix_t(Z, limit);
+      printf ("\n");
       fflush(stdout);
     }
-    /* Free space for file names */
-    free(fn1);
-    free(fn2);
-    free(fn3);
-    /* Free space for matrices */
-    free(X);
-    free(Y);
-    free(Z);
+
+    /* Write the result to a file */
+    if (serial_io && (id == 0)) {
+      if (Z_mapped) matrix_unmap(Z, 1);
+      if (Z_mapped || fwrite_matrix_t(Z, N, fn3)) {
+	printf("Result of matrix multiplication written in file %s\n", fn3);
+	fflush(stdout);
+      }
+      /* Free space for matrices */
+      if (X_mapped) matrix_unmap(X, 0); else free(X);
+      if (Y_mapped) matrix_unmap(Y, 0); else free(Y);
+      if (!Z_mapped) free(Z);
+    }
+  } while (batch && next_job(manifest, fn1, fn2, fn3, id));
+
+  if (batch && (id == 0)) {
+    printf("Batch of %d jobs done in %.1f seconds, %d failed\n", job,
+	   MPI_Wtime()-batch_start, failed);
+    fflush(stdout);
+    fclose(manifest);
   }
+  if (use_plan) fox_plan_free(&plan);
+
+  /* Free space for file names */
+  free(fn1);
+  free(fn2);
+  free(fn3);
 
   /* Free the local matrices */
-  free(X_local);
-  free(Y_local);
+  if (use_shm) {
+    shm_free(&shm, &grid);
+  } else {
+    free(X_local);
+    free(Y_local);
+  }
   free(Z_local);
   free(tmp);
+  free(Z_first);
+  free(strassen_work);
   /* Free the created communicators */
+  MPI_Comm_free(&cube_comm);
+  MPI_Comm_free(&depth_comm);
   MPI_Comm_free(&grid_comm);
   MPI_Comm_free(&row_comm);
   MPI_Comm_free(&col_comm);
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Benchmark of the matrix multiplication programs. Runs fox for every
+# combination of the given matrix sizes, numbers of processes and
+# algorithms, and appends the time of every stage in every process to
+# one CSV file, or JSON file if it ends in .json (see fox -stats).
+# Combinations that fox can't run, like a size that the grid doesn't
+# divide, are skipped. The input matrices are made with creatematrix.
+#
+#   foxbench.sh [-n sizes] [-p nprocs] [-a algorithms] [-o file]
+#               [-x "fox options"]
+#
+# for instance  foxbench.sh -n "1024 2048" -p "1 4 16" -a "fox summa"
+# The MPI launcher can be set in MPIRUN, as in
+#   MPIRUN="mpirun --oversubscribe" foxbench.sh
+
+sizes="512 1024 2048"
+nprocs="1 4 9 16"
+algorithms="fox"
+out="bench.csv"
+options=""
+mpirun=${MPIRUN:-mpirun}
+
+while getopts "n:p:a:o:x:h" c; do
+  case $c in
+    n) sizes=$OPTARG ;;
+    p) nprocs=$OPTARG ;;
+    a) algorithms=$OPTARG ;;
+    o) out=$OPTARG ;;
+    x) options=$OPTARG ;;
+    *) sed -n '2,15s/^# \{0,1\}//p' "$0"; exit 1 ;;
+  esac
+done
+
+for n in $sizes; do
+  # The same inputs are used for all grids and algorithms
+  [ -f bench_A$n.dat ] || ./creatematrix -n $n -o bench_A$n.dat -s 1 -D uniform > /dev/null
+  [ -f bench_B$n.dat ] || ./creatematrix -n $n -o bench_B$n.dat -s 2 -D uniform > /dev/null
+  for np in $nprocs; do
+    for a in $algorithms; do
+      printf "N = %-6d processes %-4d %-8s" $n $np $a
+      printf "%d\nbench_A%d.dat bench_B%d.dat\nbench_C.dat\n" $n $n $n |
+        $mpirun -np $np ./fox -a $a -stats=$out $options > bench.log 2>&1
+      if grep -q "GFLOP/s" bench.log; then
+        grep "GFLOP/s" bench.log | sed 's/^ *//'
+      else
+        echo "skipped: $(grep -v '^ *$' bench.log | tail -1)"
+      fi
+    done
+  done
+done
+rm -f bench_C.dat bench.log
+echo "Results in $out"
@@ -1,42 +1,445 @@
 /* Functions to read and write matrices in binary format.
-   Compile with  gcc -O2 -c matrixutil.c   
+   Compile with  gcc -O3 -march=native -fopenmp -c matrixutil.c
+   (-march=native enables the AVX2/AVX-512 kernel in matrixmult_block,
+   -fopenmp the threads in matrixmult_slice)
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
-/* Reads a matrix M of size N*N from the file fn in binary format
-   Returns zero if the file couldn't be opened, otherwise 1  */
-int fread_matrix(float *M, int N, char *fn) {
+#include "matrixutil.h"
+
+/* Matrix files start with a header of MATRIX_HEADER_SIZE bytes (see
+   matrixutil.h) followed by the elements, either row by row or tile by
+   tile. The elements are floats, doubles, int8 or int32, as given by
+   the type in the header. Files without a header, holding just the
+   N*N floats row by row, can still be read with fread_matrix. */
+
+/* Returns the size in bytes of the elements of the given type */
+int matrix_elem_size(int type) {
+  switch (type) {
+  case MATRIX_DOUBLE: return(sizeof(double));
+  case MATRIX_INT8:   return(sizeof(int8_t));
+  case MATRIX_INT32:  return(sizeof(int32_t));
+  default:            return(sizeof(float));
+  }
+}
+
+/* Returns element k of the elements D of the given type, as a double */
+double matrix_get(const void *D, int type, long k) {
+  switch (type) {
+  case MATRIX_DOUBLE: return(((const double *) D)[k]);
+  case MATRIX_INT8:   return(((const int8_t *) D)[k]);
+  case MATRIX_INT32:  return(((const int32_t *) D)[k]);
+  default:            return(((const float *) D)[k]);
+  }
+}
+
+/* Stores x as element k of the elements D of the given type, rounded
+   to the nearest integer for the integer types */
+static void set_elem(void *D, int type, long k, double x) {
+  switch (type) {
+  case MATRIX_DOUBLE: ((double *) D)[k] = x; break;
+  case MATRIX_INT8:   ((int8_t *) D)[k] = (int8_t) lrint(x); break;
+  case MATRIX_INT32:  ((int32_t *) D)[k] = (int32_t) lrint(x); break;
+  default:            ((float *) D)[k] = (float) x;
+  }
+}
+
+/* Mixes the bits of x, from the splitmix64 generator */
+static uint64_t mix64(uint64_t x) {
+  x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return(x);
+}
+
+/* Returns the checksum of the n elements in M, where M[0] is element
+   first of the matrix counted row by row. The checksum of a matrix is
+   the sum of the checksums of its parts, so it can be computed for any
+   division of the matrix, in any order, by any number of processes. */
+uint64_t matrix_checksum(const float *M, long n, long first) {
+  uint64_t sum = 0;
+  uint32_t bits;
+  long i;
+  for (i=0; i<n; i++) {
+    memcpy(&bits, M+i, sizeof(bits));
+    sum += mix64(bits+(uint64_t) (first+i)*0x9e3779b97f4a7c15ULL);
+  }
+  return(sum);
+}
+
+/* As matrix_checksum, for a matrix of doubles */
+uint64_t matrix_checksum_d(const double *M, long n, long first) {
+  uint64_t sum = 0, bits;
+  long i;
+  for (i=0; i<n; i++) {
+    memcpy(&bits, M+i, sizeof(bits));
+    sum += mix64(bits+(uint64_t) (first+i)*0x9e3779b97f4a7c15ULL);
+  }
+  return(sum);
+}
+
+/* As matrix_checksum, for a matrix of int8 */
+uint64_t matrix_checksum_i8(const int8_t *M, long n, long first) {
+  uint64_t sum = 0;
+  long i;
+  for (i=0; i<n; i++)
+    sum += mix64((uint8_t) M[i]+(uint64_t) (first+i)*0x9e3779b97f4a7c15ULL);
+  return(sum);
+}
+
+/* As matrix_checksum, for a matrix of int32 */
+uint64_t matrix_checksum_i32(const int32_t *M, long n, long first) {
+  uint64_t sum = 0;
+  long i;
+  for (i=0; i<n; i++)
+    sum += mix64((uint32_t) M[i]+(uint64_t) (first+i)*0x9e3779b97f4a7c15ULL);
+  return(sum);
+}
+
+/* As matrix_checksum, for n elements of the given type */
+uint64_t matrix_checksum_type(const void *M, int type, long n, long first) {
+  switch (type) {
+  case MATRIX_DOUBLE: return(matrix_checksum_d((const double *) M, n, first));
+  case MATRIX_INT8:   return(matrix_checksum_i8((const int8_t *) M, n, first));
+  case MATRIX_INT32:  return(matrix_checksum_i32((const int32_t *) M, n, first));
+  default:            return(matrix_checksum((const float *) M, n, first));
+  }
+}
+
+/* Returns the position in the element data of the file of element (i,j)
+   of the matrix. In the tiled layout the tiles are stored row by row,
+   and the elements of each tile row by row. Tiles at the right and
+   bottom edges are only as big as needed. */
+long matrix_index(const matrix_header_t *hdr, long i, long j) {
+  long tile, ti, tj, h, w;
+  if (hdr->layout != MATRIX_TILED) return(i*(long) hdr->cols+j);
+  tile = hdr->tile;
+  ti = i/tile; tj = j/tile;
+  h = ((long) hdr->rows-ti*tile < tile) ? (long) hdr->rows-ti*tile : tile;
+  w = ((long) hdr->cols-tj*tile < tile) ? (long) hdr->cols-tj*tile : tile;
+  return(ti*tile*(long) hdr->cols+tj*tile*h+(i-ti*tile)*w+(j-tj*tile));
+}
+
+/* Returns the checksum of the element data D of a whole matrix with
+   the header hdr, in either layout */
+static uint64_t data_checksum(const void *D, const matrix_header_t *hdr) {
+  uint64_t sum = 0;
+  long i, j0, w, tile;
+  tile = (hdr->layout == MATRIX_TILED) ? (long) hdr->tile : (long) hdr->cols;
+  /* Sum the checksums of the rows of each tile, with threads if we
+     have them since the matrix can be big */
+#pragma omp parallel for private(j0, w) reduction(+:sum) schedule(static)
+  for (i=0; i<(long) hdr->rows; i++) {
+    for (j0=0; j0<(long) hdr->cols; j0+=tile) {
+      w = ((long) hdr->cols-j0 < tile) ? (long) hdr->cols-j0 : tile;
+      sum += matrix_checksum_type((const char *) D+matrix_elem_size(hdr->type)*
+                                  matrix_index(hdr, i, j0), hdr->type, w,
+                                  i*(long) hdr->cols+j0);
+    }
+  }
+  return(sum);
+}
+
+/* Fills in a header for a rows*cols matrix with elements of the given
+   type. tile is only used for the tiled layout */
+void matrix_header(matrix_header_t *hdr, int type, long rows, long cols,
+                   int layout, long tile) {
+  memset(hdr, 0, sizeof(matrix_header_t));
+  hdr->magic = MATRIX_MAGIC;
+  hdr->version = MATRIX_VERSION;
+  hdr->type = type;
+  hdr->layout = layout;
+  hdr->rows = rows;
+  hdr->cols = cols;
+  hdr->tile = (layout == MATRIX_TILED) ? tile : 0;
+}
+
+/* Checks that hdr is a header we can read. Returns 1 if it is */
+int matrix_header_ok(const matrix_header_t *hdr) {
+  return(hdr->magic == MATRIX_MAGIC && hdr->version == MATRIX_VERSION &&
+         hdr->type >= MATRIX_FLOAT && hdr->type <= MATRIX_INT32 &&
+         (hdr->layout == MATRIX_ROWMAJOR ||
+          (hdr->layout == MATRIX_TILED && hdr->tile > 0)));
+}
+
+
+/* Maps the matrix in file fn into memory and returns a pointer to its
+   elements, stored as described by the header that is copied to hdr.
+   The elements are of the type given in the header.
+   No data is read until it is used. Returns NULL if the file couldn't
+   be opened or has no valid header. Unmap it with matrix_unmap */
+void *matrix_map(char *fn, matrix_header_t *hdr) {
+  int fd;
+  struct stat st;
+  char *base;
+  size_t size;
+
+  if ((fd=open(fn, O_RDONLY)) < 0) {
+    printf("Couldn't open file %s\n", fn);
+    return(NULL);
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < MATRIX_HEADER_SIZE ||
+      pread(fd, hdr, sizeof(matrix_header_t), 0) != sizeof(matrix_header_t) ||
+      !matrix_header_ok(hdr)) {
+    close(fd);
+    return(NULL);
+  }
+  size = MATRIX_HEADER_SIZE+matrix_elem_size(hdr->type)*hdr->rows*hdr->cols;
+  if (st.st_size < (off_t) size) {
+    close(fd);
+    return(NULL);
+  }
+  base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return(NULL);
+  return(base+MATRIX_HEADER_SIZE);
+}
+
+
+/* Creates the file fn for a rows*cols matrix of elements of the given
+   type, with the given layout,
+   maps it into memory and returns a pointer to the elements, which
+   can then be filled in place. The checksum is computed when the file
+   is closed with matrix_unmap. Returns NULL if the file couldn't be
+   created */
+void *matrix_create(char *fn, int type, long rows, long cols, int layout,
+                    long tile) {
+  int fd;
+  size_t size = MATRIX_HEADER_SIZE+matrix_elem_size(type)*rows*cols;
+  char *base;
+
+  if ((fd=open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+    printf("Couldn't open file %s\n", fn);
+    return(NULL);
+  }
+  if (ftruncate(fd, size) < 0) {
+    printf("Couldn't make file %s %ld bytes long\n", fn, (long) size);
+    close(fd);
+    return(NULL);
+  }
+  base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return(NULL);
+  matrix_header((matrix_header_t *) base, type, rows, cols, layout, tile);
+  return(base+MATRIX_HEADER_SIZE);
+}
+
+
+/* Unmaps a matrix mapped by matrix_map or matrix_create. If update is
+   set the matrix was created with matrix_create, and its checksum is
+   stored in the header before the file is closed */
+void matrix_unmap(void *M, int update) {
+  char *base = ((char *) M)-MATRIX_HEADER_SIZE;
+  matrix_header_t *hdr = (matrix_header_t *) base;
+  size_t size = MATRIX_HEADER_SIZE+
+    matrix_elem_size(hdr->type)*hdr->rows*hdr->cols;
+  if (update) {
+    hdr->checksum = data_checksum(M, hdr);
+    msync(base, size, MS_SYNC);
+  }
+  munmap(base, size);
+}
+
+
+/* Returns 1 if the checksum of the mapped matrix M is correct */
+int matrix_verify(const void *M, const matrix_header_t *hdr) {
+  return(data_checksum(M, hdr) == hdr->checksum);
+}
+
+
+/* Philox4x32-10 counter-based random number generator (Salmon et al.,
+   "Parallel random numbers: as easy as 1, 2, 3", SC 2011). It maps a
+   128-bit counter and a 64-bit key to 128 random bits, so any element
+   of a random matrix can be generated on its own, by any thread or
+   process, without generating the ones before it. */
+static void philox4x32(uint32_t ctr[4], const uint32_t key[2]) {
+  uint32_t k0 = key[0], k1 = key[1];
+  uint64_t p0, p1;
+  int r;
+  for (r=0; r<10; r++) {
+    p0 = (uint64_t) 0xd2511f53*ctr[0];
+    p1 = (uint64_t) 0xcd9e8d57*ctr[2];
+    ctr[0] = (uint32_t) (p1 >> 32)^ctr[1]^k0;
+    ctr[1] = (uint32_t) p1;
+    ctr[2] = (uint32_t) (p0 >> 32)^ctr[3]^k1;
+    ctr[3] = (uint32_t) p0;
+    k0 += 0x9e3779b9; k1 += 0xbb67ae85;
+  }
+}
+
+/* Returns element index (counted row by row) of the random matrix
+   given by seed, with the distribution dist:
+     MATRIX_RAND_INT      integers -3..6, as the old rand()%10-3
+     MATRIX_RAND_UNIFORM  uniform in [-1,1)
+     MATRIX_RAND_NORMAL   normal with mean 0 and variance 1
+   The same seed gives the same matrix whatever order the elements are
+   generated in. */
+float matrix_random(uint64_t seed, int dist, uint64_t index) {
+  uint32_t ctr[4], key[2];
+  double u1, u2;
+  ctr[0] = (uint32_t) index;
+  ctr[1] = (uint32_t) (index >> 32);
+  ctr[2] = (uint32_t) dist;
+  ctr[3] = 0;
+  key[0] = (uint32_t) seed;
+  key[1] = (uint32_t) (seed >> 32);
+  philox4x32(ctr, key);
+  switch (dist) {
+  case MATRIX_RAND_UNIFORM:
+    return((float) ((ctr[0] >> 8)*(2.0/16777216.0)-1.0));
+  case MATRIX_RAND_NORMAL:
+    /* Box-Muller, with u1 in (0,1] so the logarithm is finite */
+    u1 = ((ctr[0] >> 11)+((uint64_t) ctr[1] << 21)+1.0)/9007199254740992.0;
+    u2 = ctr[2]/4294967296.0;
+    return((float) (sqrt(-2.0*log(u1))*cos(6.283185307179586*u2)));
+  default:
+    return((float) (ctr[0]%10)-3.0f);
+  }
+}
+
+
+/* Reads the size of the matrix in the file fn from its header into
+   rows and cols. Returns zero if the file has no valid header */
+int matrix_shape(char *fn, long *rows, long *cols) {
   FILE *fp;
-  int i;
+  matrix_header_t hdr;
+  int ok;
+  if ((fp=fopen(fn, "rb")) == NULL) return(0);
+  ok = (fread(&hdr, sizeof(hdr), 1, fp) == 1) && matrix_header_ok(&hdr);
+  fclose(fp);
+  if (ok) {
+    *rows = hdr.rows;
+    *cols = hdr.cols;
+  }
+  return(ok);
+}
+
+
+/* Reads a matrix M of size rows*cols with elements of the given type
+   from the file fn in binary format. Files with a header are checked
+   against the size and the checksum, tiled files are stored row by row
+   in M, and elements of another type are converted. Files without a
+   header must hold exactly rows*cols floats.
+   Returns zero if the file couldn't be read, otherwise 1  */
+int matrix_read(void *M, int type, int rows, int cols, char *fn) {
+  FILE *fp;
+  matrix_header_t hdr;
+  long i, j, n = (long) rows*cols, size;
+  void *D;
+  int ok;
+
   /* Open the file */
   if ((fp=fopen(fn, "r")) == NULL) {
     printf("Couldn't open file %s\n", fn);
     return(0);
   }
-  /* Read the matrix from the file fn in binary format */
-  fread(M, sizeof(float), N*N, fp);
-  fclose (fp);
-  return(1);
-}  
+  fseek(fp, 0, SEEK_END);
+  size = ftell(fp);
+  rewind(fp);
 
+  /* Old files without a header hold floats */
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != MATRIX_MAGIC) {
+    rewind(fp);
+    matrix_header(&hdr, MATRIX_FLOAT, rows, cols, MATRIX_ROWMAJOR, 0);
+    D = (type == MATRIX_FLOAT) ? M : malloc(sizeof(float)*n);
+    ok = (size == n*(long) sizeof(float)) &&
+      (fread(D, sizeof(float), n, fp) == (size_t) n);
+    fclose(fp);
+    if (!ok) printf("File %s doesn't hold a %d*%d matrix\n", fn, rows, cols);
+  } else {
+    if (!matrix_header_ok(&hdr) || hdr.rows != (uint64_t) rows ||
+        hdr.cols != (uint64_t) cols) {
+      printf("File %s doesn't hold a %d*%d matrix\n", fn, rows, cols);
+      fclose(fp);
+      return(0);
+    }
+    /* Read the elements, via a temporary if the file is tiled or */
+    /* holds another type */
+    D = (hdr.layout == MATRIX_ROWMAJOR && hdr.type == (uint32_t) type) ? M :
+      malloc(matrix_elem_size(hdr.type)*n);
+    fseek(fp, MATRIX_HEADER_SIZE, SEEK_SET);
+    ok = (fread(D, matrix_elem_size(hdr.type), n, fp) == (size_t) n);
+    fclose(fp);
+    if (ok && !(ok=(data_checksum(D, &hdr) == hdr.checksum)))
+      printf("Checksum error in file %s\n", fn);
+  }
+  if (D != M) {
+    for (i=0; i<rows; i++)
+      for (j=0; j<cols; j++)
+        set_elem(M, type, i*cols+j,
+                 matrix_get(D, hdr.type, matrix_index(&hdr, i, j)));
+    free(D);
+  }
+  return(ok);
+}
 
-/* Writes a matrix M of size N*N to the file fn in binary format
-   Returns zero if the file couldn't be opened, otherwise 1       */
-int fwrite_matrix(float *M, int N, char *fn) {
+/* Reads a matrix M of N*N floats from the file fn, see matrix_read */
+int fread_matrix(float *M, int N, char *fn) {
+  return(matrix_read(M, MATRIX_FLOAT, N, N, fn));
+}
+
+/* Reads a matrix M of N*N doubles from the file fn, see matrix_read */
+int fread_matrix_d(double *M, int N, char *fn) {
+  return(matrix_read(M, MATRIX_DOUBLE, N, N, fn));
+}
+
+/* Reads a matrix M of N*N int8 from the file fn, see matrix_read */
+int fread_matrix_i8(int8_t *M, int N, char *fn) {
+  return(matrix_read(M, MATRIX_INT8, N, N, fn));
+}
+
+
+/* Writes a matrix M of size rows*cols with elements of the given type
+   to the file fn in binary format, with a header and the elements row
+   by row. Returns zero if the file couldn't be opened, otherwise 1  */
+int matrix_write(const void *M, int type, int rows, int cols, char *fn) {
   FILE *fp;
-  int i;
+  matrix_header_t hdr;
   /* Open the file */
   if ((fp=fopen(fn, "w")) == NULL) {
     printf("Couldn't open file %s\n", fn);
     return 0;
   }
+  matrix_header(&hdr, type, rows, cols, MATRIX_ROWMAJOR, 0);
+  hdr.checksum = data_checksum(M, &hdr);
   /* Write the matrix to the file fn in binary format */
-  fwrite(M, sizeof(float), N*N, fp);
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+  fwrite(M, matrix_elem_size(type), (long) rows*cols, fp);
   fclose(fp);  /* Close the file */
   return(1);
 }
 
+/* Writes a matrix M of N*N floats to the file fn */
+int fwrite_matrix(float *M, int N, char *fn) {
+  return(matrix_write(M, MATRIX_FLOAT, N, N, fn));
+}
+
+/* Writes a matrix M of N*N doubles to the file fn */
+int fwrite_matrix_d(double *M, int N, char *fn) {
+  return(matrix_write(M, MATRIX_DOUBLE, N, N, fn));
+}
+
+/* Writes a matrix M of N*N int32 to the file fn */
+int fwrite_matrix_i32(int32_t *M, int N, char *fn) {
+  return(matrix_write(M, MATRIX_INT32, N, N, fn));
+}
+
 
 /* Prints a matrix of size N*N  */
 void write_matrix(float *M, int N) {
@@ -52,22 +455,832 @@ void write_matrix(float *M, int N) {
 }
 
 
+/* Prints a matrix of doubles of size N*N  */
+void write_matrix_d(double *M, int N) {
+  int i, j;
+  for (i=0; i<N; i++) {
+    for (j=0; j<N; j++) {
+      printf("%5.1f ", M[i*N+j]);
+    }
+    printf("\n");
+  }
+  printf("\n");
+}
+
+
+/* Prints a matrix of int8 of size N*N  */
+void write_matrix_i8(int8_t *M, int N) {
+  int i, j;
+  for (i=0; i<N; i++) {
+    for (j=0; j<N; j++) {
+      printf("%5d ", M[i*N+j]);
+    }
+    printf("\n");
+  }
+  printf("\n");
+}
+
+
+/* Prints a matrix of int32 of size N*N  */
+void write_matrix_i32(int32_t *M, int N) {
+  int i, j;
+  for (i=0; i<N; i++) {
+    for (j=0; j<N; j++) {
+      printf("%5d ", M[i*N+j]);
+    }
+    printf("\n");
+  }
+  printf("\n");
+}
+
+
 /* Multplies two square matrices X and Y of order N and places the
    result in Z. The matrix Z is assumed to be initialized to zero  */
 void matrixmult(float *X, float *Y, float *Z, int N) {
+  matrixmult_rect(N, N, N, X, N, Y, N, Z, N);
+}
+
+/* Multiplies the M*K matrix X with the K*N matrix Y and adds the result
+   to the M*N matrix Z, with the row strides ldx, ldy and ldz. The plain
+   triple loop, as a reference for the blocked kernels */
+void matrixmult_rect(int M, int N, int K, float *X, int ldx, float *Y,
+                     int ldy, float *Z, int ldz) {
   int i,j,k;
-  for (i=0; i<N; i++) {
+  for (i=0; i<M; i++) {
     for (j=0; j<N; j++) {
-      for (k=0; k<N; k++) Z[i*N+j] += X[i*N+k]*Y[k*N+j];
+      for (k=0; k<K; k++)
+        Z[(long) i*ldz+j] += X[(long) i*ldx+k]*Y[(long) k*ldy+j];
     }
   }
 }
 
+
+/* Register tiling of the micro-kernel used by matrixmult_block.
+   The micro-kernel keeps an MR*NR tile of Z in registers and updates
+   it with a rank-1 product for every k. The width NR is a multiple of
+   the SIMD vector length of the instruction set we are compiled for,
+   and NR_D the same for doubles. */
+#if defined(__AVX512F__)
+#define MR 6
+#define NR 32
+#elif defined(__AVX2__) && defined(__FMA__)
+#define MR 6
+#define NR 16
+#else
+#define MR 4
+#define NR 4
+#endif
+#define MR_D MR               /* Register tile for doubles */
+#define NR_D (NR > 4 ? NR/2 : NR)
+
+/* Register tile for int8, accumulated in int32 with as many lanes per
+   vector as floats. The AVX-512 kernel needs the word instructions of
+   AVX-512BW, the AVX2 one needs no FMA */
+#if defined(__AVX512BW__)
+#define MR_I8 6
+#define NR_I8 32
+#elif defined(__AVX2__)
+#define MR_I8 6
+#define NR_I8 16
+#else
+#define MR_I8 4
+#define NR_I8 4
+#endif
+
+/* Blocking parameters used when the kernels get blocksize<=0, one set
+   for the float kernel and one for the double kernel, which the mixed
+   kernel shares. They can be replaced by a profile made by
+   matrix_autotune, see matrix_tuning_load */
+matrix_tuning_t matrix_tuning   = { 256, 256, 4096 };
+matrix_tuning_t matrix_tuning_d = { 256, 256, 4096 };
+
+
+/* Computes C += A*B for an MR*NR tile, where A is a packed MR*kc
+   micro-panel (column by column) and B a packed kc*NR micro-panel
+   (row by row). C has the row stride ldc. */
+static void micro_kernel(int kc, const float *A, const float *B,
+                         float *C, int ldc) {
+  int i, p;
+#if defined(__AVX512F__)
+  __m512 c0[MR], c1[MR];
+  for (i=0; i<MR; i++) {
+    c0[i] = _mm512_setzero_ps();
+    c1[i] = _mm512_setzero_ps();
+  }
+  for (p=0; p<kc; p++) {
+    __m512 b0 = _mm512_load_ps(B);
+    __m512 b1 = _mm512_load_ps(B+16);
+    for (i=0; i<MR; i++) {
+      __m512 a = _mm512_set1_ps(A[i]);
+      c0[i] = _mm512_fmadd_ps(a, b0, c0[i]);
+      c1[i] = _mm512_fmadd_ps(a, b1, c1[i]);
+    }
+    A += MR; B += NR;
+  }
+  for (i=0; i<MR; i++) {
+    float *c = C+i*ldc;
+    _mm512_storeu_ps(c,    _mm512_add_ps(_mm512_loadu_ps(c),    c0[i]));
+    _mm512_storeu_ps(c+16, _mm512_add_ps(_mm512_loadu_ps(c+16), c1[i]));
+  }
+#elif defined(__AVX2__) && defined(__FMA__)
+  __m256 c0[MR], c1[MR];
+  for (i=0; i<MR; i++) {
+    c0[i] = _mm256_setzero_ps();
+    c1[i] = _mm256_setzero_ps();
+  }
+  for (p=0; p<kc; p++) {
+    __m256 b0 = _mm256_load_ps(B);
+    __m256 b1 = _mm256_load_ps(B+8);
+    for (i=0; i<MR; i++) {
+      __m256 a = _mm256_broadcast_ss(A+i);
+      c0[i] = _mm256_fmadd_ps(a, b0, c0[i]);
+      c1[i] = _mm256_fmadd_ps(a, b1, c1[i]);
+    }
+    A += MR; B += NR;
+  }
+  for (i=0; i<MR; i++) {
+    float *c = C+i*ldc;
+    _mm256_storeu_ps(c,   _mm256_add_ps(_mm256_loadu_ps(c),   c0[i]));
+    _mm256_storeu_ps(c+8, _mm256_add_ps(_mm256_loadu_ps(c+8), c1[i]));
+  }
+#else
+  float c[MR][NR];
+  int j;
+  for (i=0; i<MR; i++)
+    for (j=0; j<NR; j++) c[i][j] = 0.0;
+  for (p=0; p<kc; p++) {
+    for (i=0; i<MR; i++)
+      for (j=0; j<NR; j++) c[i][j] += A[i]*B[j];
+    A += MR; B += NR;
+  }
+  for (i=0; i<MR; i++)
+    for (j=0; j<NR; j++) C[i*ldc+j] += c[i][j];
+#endif
+}
+
+
+/* As micro_kernel, for doubles. The tile is MR_D*NR_D, half as wide
+   as for floats since a SIMD vector holds half as many doubles. */
+static void micro_kernel_d(int kc, const double *A, const double *B,
+                           double *C, int ldc) {
+  int i, p;
+#if defined(__AVX512F__)
+  __m512d c0[MR_D], c1[MR_D];
+  for (i=0; i<MR_D; i++) {
+    c0[i] = _mm512_setzero_pd();
+    c1[i] = _mm512_setzero_pd();
+  }
+  for (p=0; p<kc; p++) {
+    __m512d b0 = _mm512_load_pd(B);
+    __m512d b1 = _mm512_load_pd(B+8);
+    for (i=0; i<MR_D; i++) {
+      __m512d a = _mm512_set1_pd(A[i]);
+      c0[i] = _mm512_fmadd_pd(a, b0, c0[i]);
+      c1[i] = _mm512_fmadd_pd(a, b1, c1[i]);
+    }
+    A += MR_D; B += NR_D;
+  }
+  for (i=0; i<MR_D; i++) {
+    double *c = C+i*ldc;
+    _mm512_storeu_pd(c,   _mm512_add_pd(_mm512_loadu_pd(c),   c0[i]));
+    _mm512_storeu_pd(c+8, _mm512_add_pd(_mm512_loadu_pd(c+8), c1[i]));
+  }
+#elif defined(__AVX2__) && defined(__FMA__)
+  __m256d c0[MR_D], c1[MR_D];
+  for (i=0; i<MR_D; i++) {
+    c0[i] = _mm256_setzero_pd();
+    c1[i] = _mm256_setzero_pd();
+  }
+  for (p=0; p<kc; p++) {
+    __m256d b0 = _mm256_load_pd(B);
+    __m256d b1 = _mm256_load_pd(B+4);
+    for (i=0; i<MR_D; i++) {
+      __m256d a = _mm256_broadcast_sd(A+i);
+      c0[i] = _mm256_fmadd_pd(a, b0, c0[i]);
+      c1[i] = _mm256_fmadd_pd(a, b1, c1[i]);
+    }
+    A += MR_D; B += NR_D;
+  }
+  for (i=0; i<MR_D; i++) {
+    double *c = C+i*ldc;
+    _mm256_storeu_pd(c,   _mm256_add_pd(_mm256_loadu_pd(c),   c0[i]));
+    _mm256_storeu_pd(c+4, _mm256_add_pd(_mm256_loadu_pd(c+4), c1[i]));
+  }
+#else
+  double c[MR_D][NR_D];
+  int j;
+  for (i=0; i<MR_D; i++)
+    for (j=0; j<NR_D; j++) c[i][j] = 0.0;
+  for (p=0; p<kc; p++) {
+    for (i=0; i<MR_D; i++)
+      for (j=0; j<NR_D; j++) c[i][j] += A[i]*B[j];
+    A += MR_D; B += NR_D;
+  }
+  for (i=0; i<MR_D; i++)
+    for (j=0; j<NR_D; j++) C[i*ldc+j] += c[i][j];
+#endif
+}
+
+
+/* As micro_kernel, for int8 elements accumulated in int32. The packed
+   panels hold the elements widened to int16 with pairs of consecutive k
+   side by side, so one multiply-add of int16 pairs into int32 (vpmaddwd,
+   or vpdpwssd with VNNI) does two steps of k exactly. Unlike vpmaddubsw
+   on the bytes it never saturates, and needs no unsigned operand.
+   kc is even. */
+static void micro_kernel_i8(int kc, const int16_t *A, const int16_t *B,
+                            int32_t *C, int ldc) {
+  int i, p;
+#if defined(__AVX512BW__)
+  __m512i c0[MR_I8], c1[MR_I8];
+  int32_t pair;
+  for (i=0; i<MR_I8; i++) {
+    c0[i] = _mm512_setzero_si512();
+    c1[i] = _mm512_setzero_si512();
+  }
+  for (p=0; p<kc; p+=2) {
+    __m512i b0 = _mm512_load_si512(B);
+    __m512i b1 = _mm512_load_si512(B+32);
+    for (i=0; i<MR_I8; i++) {
+      memcpy(&pair, A+2*i, sizeof(pair));
+      __m512i a = _mm512_set1_epi32(pair);
+#if defined(__AVX512VNNI__)
+      c0[i] = _mm512_dpwssd_epi32(c0[i], a, b0);
+      c1[i] = _mm512_dpwssd_epi32(c1[i], a, b1);
+#else
+      c0[i] = _mm512_add_epi32(c0[i], _mm512_madd_epi16(a, b0));
+      c1[i] = _mm512_add_epi32(c1[i], _mm512_madd_epi16(a, b1));
+#endif
+    }
+    A += 2*MR_I8; B += 2*NR_I8;
+  }
+  for (i=0; i<MR_I8; i++) {
+    int32_t *c = C+i*ldc;
+    _mm512_storeu_si512(c, _mm512_add_epi32(_mm512_loadu_si512(c), c0[i]));
+    _mm512_storeu_si512(c+16, _mm512_add_epi32(_mm512_loadu_si512(c+16),
+                                               c1[i]));
+  }
+#elif defined(__AVX2__)
+  __m256i c0[MR_I8], c1[MR_I8];
+  int32_t pair;
+  for (i=0; i<MR_I8; i++) {
+    c0[i] = _mm256_setzero_si256();
+    c1[i] = _mm256_setzero_si256();
+  }
+  for (p=0; p<kc; p+=2) {
+    __m256i b0 = _mm256_load_si256((const __m256i *) B);
+    __m256i b1 = _mm256_load_si256((const __m256i *) (B+16));
+    for (i=0; i<MR_I8; i++) {
+      memcpy(&pair, A+2*i, sizeof(pair));
+      __m256i a = _mm256_set1_epi32(pair);
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+      c0[i] = _mm256_dpwssd_epi32(c0[i], a, b0);
+      c1[i] = _mm256_dpwssd_epi32(c1[i], a, b1);
+#elif defined(__AVXVNNI__)
+      c0[i] = _mm256_dpwssd_avx_epi32(c0[i], a, b0);
+      c1[i] = _mm256_dpwssd_avx_epi32(c1[i], a, b1);
+#else
+      c0[i] = _mm256_add_epi32(c0[i], _mm256_madd_epi16(a, b0));
+      c1[i] = _mm256_add_epi32(c1[i], _mm256_madd_epi16(a, b1));
+#endif
+    }
+    A += 2*MR_I8; B += 2*NR_I8;
+  }
+  for (i=0; i<MR_I8; i++) {
+    __m256i *c = (__m256i *) (C+i*ldc);
+    _mm256_storeu_si256(c, _mm256_add_epi32(_mm256_loadu_si256(c), c0[i]));
+    _mm256_storeu_si256(c+1, _mm256_add_epi32(_mm256_loadu_si256(c+1), c1[i]));
+  }
+#else
+  int32_t c[MR_I8][NR_I8];
+  int j;
+  for (i=0; i<MR_I8; i++)
+    for (j=0; j<NR_I8; j++) c[i][j] = 0;
+  for (p=0; p<kc; p+=2) {
+    for (i=0; i<MR_I8; i++)
+      for (j=0; j<NR_I8; j++)
+        c[i][j] += A[2*i]*B[2*j]+A[2*i+1]*B[2*j+1];
+    A += 2*MR_I8; B += 2*NR_I8;
+  }
+  for (i=0; i<MR_I8; i++)
+    for (j=0; j<NR_I8; j++) C[i*ldc+j] += c[i][j];
+#endif
+}
+
+
+/* The packing routines, block_gemm, matrixmult_gemm and
+   matrixmult_gemm_slice for each element type:
+     float   X, Y and Z of floats
+     _d      X, Y and Z of doubles
+     _mixed  X and Y of floats, accumulated in Z of doubles
+     _i8     X and Y of int8, accumulated in Z of int32, with the
+             blocking parameters of floats */
+#define GEMM_TX float
+#define GEMM_TZ float
+#define GEMM_MR MR
+#define GEMM_NR NR
+#define GEMM_KERNEL micro_kernel
+#define GEMM_NAME(f) f
+#define GEMM_TUNING matrix_tuning
+#include "matrixutil_gemm.h"
+
+#define GEMM_TX double
+#define GEMM_TZ double
+#define GEMM_MR MR_D
+#define GEMM_NR NR_D
+#define GEMM_KERNEL micro_kernel_d
+#define GEMM_NAME(f) f##_d
+#define GEMM_TUNING matrix_tuning_d
+#include "matrixutil_gemm.h"
+
+#define GEMM_TX float
+#define GEMM_TZ double
+#define GEMM_MR MR_D
+#define GEMM_NR NR_D
+#define GEMM_KERNEL micro_kernel_d
+#define GEMM_NAME(f) f##_mixed
+#define GEMM_TUNING matrix_tuning_d
+#include "matrixutil_gemm.h"
+
+#define GEMM_TX int8_t
+#define GEMM_TZ int32_t
+#define GEMM_TP int16_t
+#define GEMM_KU 2
+#define GEMM_MR MR_I8
+#define GEMM_NR NR_I8
+#define GEMM_KERNEL micro_kernel_i8
+#define GEMM_NAME(f) f##_i8
+#define GEMM_TUNING matrix_tuning
+#include "matrixutil_gemm.h"
+
+
+/* Multiplies two square matrices X and Y of order N and places the
+   result in Z, using a cache blocked algorithm. If blocksize is zero
+   or negative the block sizes in matrix_tuning are used.
+   The matrix Z is assumed to be initialized to zero  */
+void matrixmult_block(float *X, float *Y, float *Z, int N, int blocksize) {
+  block_gemm(N, N, N, X, N, Y, N, Z, N, blocksize);
+}
+
+
+/* Multiplies two square matrices X and Y of order N and places the
+   result in Z, using all OpenMP threads, each computing a slice of the
+   rows of Z with the blocked kernel.
+   The matrix Z is assumed to be initialized to zero  */
+void matrixmult_slice(float *X, float *Y, float *Z, int N, int blocksize) {
+  matrixmult_gemm_slice(N, N, N, X, N, Y, N, Z, N, blocksize);
+}
+
+/* Compresses the dense M*N matrix A with row stride lda into CSR format
+   in rowptr, colidx and val (see matrixmult_csr_dense), keeping the
+   elements that are not zero. rowptr must have room for M+1 and colidx
+   and val for max_nnz elements. Returns the number of nonzeros, or -1
+   if there are more than max_nnz, in which case the matrix is better
+   kept dense. */
+int matrix_csr_compress(int M, int N, const float *A, int lda, int max_nnz,
+                        int *rowptr, int *colidx, float *val) {
+  int i, j, nnz = 0;
+  for (i=0; i<M; i++) {
+    rowptr[i] = nnz;
+    for (j=0; j<N; j++) {
+      if (A[(long) i*lda+j] != 0.0f) {
+        if (nnz == max_nnz) return(-1);
+        colidx[nnz] = j;
+        val[nnz++] = A[(long) i*lda+j];
+      }
+    }
+  }
+  rowptr[M] = nnz;
+  return(nnz);
+}
+
+/* As matrix_csr_compress, for a matrix of doubles */
+int matrix_csr_compress_d(int M, int N, const double *A, int lda, int max_nnz,
+                          int *rowptr, int *colidx, double *val) {
+  int i, j, nnz = 0;
+  for (i=0; i<M; i++) {
+    rowptr[i] = nnz;
+    for (j=0; j<N; j++) {
+      if (A[(long) i*lda+j] != 0.0) {
+        if (nnz == max_nnz) return(-1);
+        colidx[nnz] = j;
+        val[nnz++] = A[(long) i*lda+j];
+      }
+    }
+  }
+  rowptr[M] = nnz;
+  return(nnz);
+}
+
+/* As matrix_csr_compress, for a matrix of int8 */
+int matrix_csr_compress_i8(int M, int N, const int8_t *A, int lda, int max_nnz,
+                           int *rowptr, int *colidx, int8_t *val) {
+  int i, j, nnz = 0;
+  for (i=0; i<M; i++) {
+    rowptr[i] = nnz;
+    for (j=0; j<N; j++) {
+      if (A[(long) i*lda+j] != 0) {
+        if (nnz == max_nnz) return(-1);
+        colidx[nnz] = j;
+        val[nnz++] = A[(long) i*lda+j];
+      }
+    }
+  }
+  rowptr[M] = nnz;
+  return(nnz);
+}
+
+/* Lossless compression of blocks of elements, for sending them. The
+   elements are shuffled into byte planes, plane b holding byte b of
+   every element, since the bytes at the same position in similar
+   numbers tend to be alike: the low mantissa bytes of small integers
+   stored as floats are all zero, and the exponent byte takes only a
+   few values. Every plane is then stored in the smallest of three
+   ways, given by its first byte:
+     PLANE_RAW   the n bytes as they are
+     PLANE_RLE   runs of equal bytes, as pairs of length-1 and value
+                 for runs of up to 256 bytes
+     PLANE_DICT  planes with at most 16 different bytes: their number,
+                 the different bytes, and the index of every byte among
+                 them in 1, 2 or 4 bits, or in none if all are equal
+   The coded planes follow each other, and their lengths follow from
+   the number of elements, so there is no other header. */
+enum { PLANE_RAW = 0, PLANE_RLE = 1, PLANE_DICT = 2 };
+
+/* Returns the largest size of n elements of size bytes compressed */
+long matrix_compress_bound(long n, int size) {
+  return(size*(n+1));
+}
+
+/* Compresses the n elements of size bytes in src into dst, which must
+   have room for matrix_compress_bound(n, size) bytes. Returns the size
+   of the compressed data, which is nothing for n == 0 */
+long matrix_compress(const void *src, long n, int size, unsigned char *dst) {
+  const unsigned char *s = (const unsigned char *) src;
+  unsigned char *d = dst, dict[16];
+  long count[256], i, run, changes, rle, packed;
+  int b, c, nsym, bits, map[256], shift;
+
+  if (n <= 0) return(0);          /* An empty block has no planes */
+  for (b=0; b<size; b++) {
+    /* Count the different bytes and the changes between neighbours in
+       the plane. Runs longer than 256 are split, so there are at most
+       changes+1+n/256 runs */
+    memset(count, 0, sizeof(count));
+    changes = 0;
+    count[s[b]]++;
+    for (i=1; i<n; i++) {
+      count[s[i*size+b]]++;
+      changes += (s[i*size+b] != s[(i-1)*size+b]);
+    }
+    for (c=0, nsym=0; c<256; c++) {
+      if (count[c] > 0) {
+        if (nsym < 16) dict[nsym] = c;
+        map[c] = nsym++;
+      }
+    }
+    bits = (nsym <= 1) ? 0 : (nsym <= 2) ? 1 : (nsym <= 4) ? 2 : 4;
+    rle = 2*(changes+1+n/256);
+    packed = (nsym <= 16) ? 1+nsym+(n*bits+7)/8 : n+1;
+
+    if (packed <= rle && packed < n) {
+      *d++ = PLANE_DICT;
+      *d++ = nsym;
+      memcpy(d, dict, nsym);
+      d += nsym;
+      if (bits > 0) {
+        memset(d, 0, (n*bits+7)/8);
+        for (i=0; i<n; i++) {
+          shift = (i*bits)%8;
+          d[i*bits/8] |= map[s[i*size+b]] << shift;
+        }
+        d += (n*bits+7)/8;
+      }
+    } else if (rle < n) {
+      *d++ = PLANE_RLE;
+      for (i=0; i<n; i+=run) {
+        for (run=1; i+run<n && run<256 &&
+               s[(i+run)*size+b] == s[i*size+b]; run++);
+        *d++ = run-1;
+        *d++ = s[i*size+b];
+      }
+    } else {
+      *d++ = PLANE_RAW;
+      for (i=0; i<n; i++) *d++ = s[i*size+b];
+    }
+  }
+  return(d-dst);
+}
+
+/* Restores the n elements of size bytes compressed by matrix_compress
+   in src into dst. Returns the size of the compressed data read */
+long matrix_decompress(const unsigned char *src, long n, int size, void *dst) {
+  const unsigned char *s = src;
+  unsigned char *d = (unsigned char *) dst;
+  const unsigned char *dict;
+  long i, k;
+  int b, nsym, bits, run, mask;
+
+  if (n <= 0) return(0);
+  for (b=0; b<size; b++) {
+    switch (*s++) {
+    case PLANE_DICT:
+      nsym = *s++;
+      dict = s;
+      s += nsym;
+      bits = (nsym <= 1) ? 0 : (nsym <= 2) ? 1 : (nsym <= 4) ? 2 : 4;
+      if (bits == 0) {
+        for (i=0; i<n; i++) d[i*size+b] = dict[0];
+      } else {
+        mask = (1 << bits)-1;
+        for (i=0; i<n; i++)
+          d[i*size+b] = dict[(s[i*bits/8] >> ((i*bits)%8)) & mask];
+        s += (n*bits+7)/8;
+      }
+      break;
+    case PLANE_RLE:
+      for (i=0; i<n; i+=run) {
+        run = *s++ + 1;
+        for (k=0; k<run; k++) d[(i+k)*size+b] = *s;
+        s++;
+      }
+      break;
+    default:
+      for (i=0; i<n; i++) d[i*size+b] = *s++;
+    }
+  }
+  return(s-src);
+}
+
+
+/* C = A + sign*B for n*n matrices stored with row strides lda, ldb, ldc */
+static void add_sub(int n, const float *A, int lda, const float *B, int ldb,
+                    float *C, int ldc, float sign) {
+  int i, j;
+  for (i=0; i<n; i++) {
+    for (j=0; j<n; j++) C[(long) i*ldc+j] = A[(long) i*lda+j]+sign*B[(long) i*ldb+j];
+  }
+}
+
+/* Computes C = A*B for n*n matrices with the Strassen-Winograd
+   algorithm, using the schedule of Douglas et al. that needs only two
+   temporaries of size (n/2)*(n/2) on each level. Below the cutoff, the
+   blocked kernel is used. If n is odd, the last row and column are
+   peeled off and handled with the blocked kernel. The leaves and the
+   peeled products reuse the packing buffers of the calling thread, so
+   apart from the first leaf nothing is allocated below this level. */
+static void strassen(int n, const float *A, int lda, const float *B, int ldb,
+                     float *C, int ldc, int cutoff, int blocksize,
+                     float *work) {
+  int h, i, m;
+  const float *A11, *A12, *A21, *A22, *B11, *B12, *B21, *B22;
+  float *C11, *C12, *C21, *C22, *S, *T;
+
+  if (n <= cutoff || n < 2) {
+    for (i=0; i<n; i++) memset(C+(long) i*ldc, 0, sizeof(float)*n);
+    block_gemm(n, n, n, A, lda, B, ldb, C, ldc, blocksize);
+    return;
+  }
+
+  h = n/2;
+  A11 = A; A12 = A+h; A21 = A+(long) h*lda; A22 = A21+h;
+  B11 = B; B12 = B+h; B21 = B+(long) h*ldb; B22 = B21+h;
+  C11 = C; C12 = C+h; C21 = C+(long) h*ldc; C22 = C21+h;
+  S = work;                   /* Temporaries of size h*h */
+  T = work+(long) h*h;
+  work += 2L*h*h;             /* Workspace for the recursive calls */
+
+  add_sub(h, A11, lda, A21, lda, S, h, -1.0);          /* S3 = A11-A21 */
+  add_sub(h, B22, ldb, B12, ldb, T, h, -1.0);          /* T3 = B22-B12 */
+  strassen(h, S, h, T, h, C21, ldc, cutoff, blocksize, work);   /* P7 */
+  add_sub(h, A21, lda, A22, lda, S, h, 1.0);           /* S1 = A21+A22 */
+  add_sub(h, B12, ldb, B11, ldb, T, h, -1.0);          /* T1 = B12-B11 */
+  strassen(h, S, h, T, h, C22, ldc, cutoff, blocksize, work);   /* P5 */
+  add_sub(h, S, h, A11, lda, S, h, -1.0);              /* S2 = S1-A11 */
+  add_sub(h, B22, ldb, T, h, T, h, -1.0);              /* T2 = B22-T1 */
+  strassen(h, S, h, T, h, C12, ldc, cutoff, blocksize, work);   /* P6 */
+  add_sub(h, A12, lda, S, h, S, h, -1.0);              /* S4 = A12-S2 */
+  strassen(h, S, h, B22, ldb, C11, ldc, cutoff, blocksize, work); /* P3 */
+  strassen(h, A11, lda, B11, ldb, S, h, cutoff, blocksize, work); /* P1 */
+  add_sub(h, S, h, C12, ldc, C12, ldc, 1.0);           /* U2 = P1+P6 */
+  add_sub(h, C12, ldc, C21, ldc, C21, ldc, 1.0);       /* U3 = U2+P7 */
+  add_sub(h, C12, ldc, C22, ldc, C12, ldc, 1.0);       /* U4 = U2+P5 */
+  add_sub(h, C21, ldc, C22, ldc, C22, ldc, 1.0);       /* C22 = U3+P5 */
+  add_sub(h, C12, ldc, C11, ldc, C12, ldc, 1.0);       /* C12 = U4+P3 */
+  add_sub(h, T, h, B21, ldb, T, h, -1.0);              /* T4 = T2-B21 */
+  strassen(h, A22, lda, T, h, C11, ldc, cutoff, blocksize, work); /* P4 */
+  add_sub(h, C21, ldc, C11, ldc, C21, ldc, -1.0);      /* C21 = U3-P4 */
+  strassen(h, A12, lda, B21, ldb, C11, ldc, cutoff, blocksize, work); /* P2 */
+  add_sub(h, S, h, C11, ldc, C11, ldc, 1.0);           /* C11 = P1+P2 */
+
+  /* Peel off the last row and column if n is odd */
+  if (n%2 == 1) {
+    m = 2*h;
+    for (i=0; i<m; i++) C[(long) i*ldc+m] = 0.0;
+    memset(C+(long) m*ldc, 0, sizeof(float)*n);
+    block_gemm(m, m, 1, A+m, lda, B+(long) m*ldb, ldb, C, ldc, blocksize);
+    block_gemm(n, 1, n, A, lda, B+m, ldb, C+m, ldc, blocksize);
+    block_gemm(1, m, n, A+(long) m*lda, lda, B, ldb, C+(long) m*ldc, ldc,
+               blocksize);
+  }
+}
+
+
+/* Returns the number of floats of workspace that matrixmult_strassen
+   needs for matrices of order N with the given cutoff */
+long strassen_worksize(int N, int cutoff) {
+  long size = (long) N*N;     /* The product before it is added to Z */
+  while (N > cutoff && N >= 2) {
+    N = N/2;
+    size += 2L*N*N;
+  }
+  return(size);
+}
+
+
+/* Multiplies two square matrices X and Y of order N with the recursive
+   Strassen-Winograd algorithm and adds the result to Z. Submatrices of
+   order cutoff or less are multiplied with the blocked kernel, using
+   the given block size. work must hold strassen_worksize(N, cutoff)
+   floats, so it can be allocated once and reused for many calls. */
+void matrixmult_strassen(float *X, float *Y, float *Z, int N, int cutoff,
+                         int blocksize, float *work) {
+  long i;
+  strassen(N, X, N, Y, N, work, N, cutoff, blocksize, work+(long) N*N);
+  for (i=0; i<(long) N*N; i++) Z[i] += work[i];
+}
+
 /* Sets the elements of the square matrix X to zero */
 void settozero(float *X, int N) {
+  settozero_rect(X, N, N, N);
+}
+
+/* Sets the elements of the M*N matrix X with row stride ldx to zero */
+void settozero_rect(float *X, int M, int N, int ldx) {
   int i,j;
-  for (i=0; i<N; i++) {
-    for (j=0; j<N; j++) X[i*N+j] = 0.0;
+  for (i=0; i<M; i++) {
+    for (j=0; j<N; j++) X[(long) i*ldx+j] = 0.0;
+  }
+}
+
+
+
+/* Autotuning of the blocking parameters. matrix_autotune times the
+   kernels for a range of block sizes on this host and leaves the best
+   ones in matrix_tuning and matrix_tuning_d. They are stored in a
+   profile, a text file with one line per element type:
+     float  6x32 mc kc nc gflops
+     double 6x16 mc kc nc gflops
+   where 6x32 is the register tile of the kernel that was tuned. Lines
+   made for another register tile, by a build for another instruction
+   set, are skipped when the profile is loaded. */
+
+/* Gives in fn the name of the profile of this host: $MATRIX_PROFILE if
+   it is set, otherwise $HOME/.matrixtune.<hostname> */
+void matrix_profile_name(char *fn, int len) {
+  char host[256];
+  char *env = getenv("MATRIX_PROFILE");
+  char *home = getenv("HOME");
+  if (env != NULL && env[0] != '\0') {
+    snprintf(fn, len, "%s", env);
+    return;
+  }
+  if (gethostname(host, sizeof(host)) != 0) strcpy(host, "localhost");
+  host[sizeof(host)-1] = '\0';
+  snprintf(fn, len, "%s/.matrixtune.%s", (home != NULL) ? home : ".", host);
+}
+
+/* Reads the blocking parameters from the profile fn into matrix_tuning
+   and matrix_tuning_d. Returns the number of element types that were
+   set, 0 if the file doesn't exist or fits no kernel of this build */
+int matrix_tuning_load(const char *fn) {
+  FILE *fp;
+  char line[256], name[16];
+  int mr, nr, n = 0;
+  matrix_tuning_t t;
+  double gflops;
+
+  if ((fp=fopen(fn, "r")) == NULL) return(0);
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "%15s %dx%d %d %d %d %lf", name, &mr, &nr,
+	       &t.mc, &t.kc, &t.nc, &gflops) < 6) continue;
+    if (t.mc <= 0 || t.kc <= 0 || t.nc <= 0) continue;
+    if (!strcmp(name, "float") && mr == MR && nr == NR) {
+      matrix_tuning = t;
+      n++;
+    } else if (!strcmp(name, "double") && mr == MR_D && nr == NR_D) {
+      matrix_tuning_d = t;
+      n++;
+    }
+  }
+  fclose(fp);
+  return(n);
+}
+
+/* Writes the blocking parameters in matrix_tuning and matrix_tuning_d,
+   with the speeds they gave, to the profile fn. Returns 1 if OK */
+int matrix_tuning_save(const char *fn, double gflops, double gflops_d) {
+  FILE *fp;
+  char host[256];
+  if ((fp=fopen(fn, "w")) == NULL) {
+    printf("Couldn't open file %s\n", fn);
+    return(0);
+  }
+  if (gethostname(host, sizeof(host)) != 0) strcpy(host, "localhost");
+  host[sizeof(host)-1] = '\0';
+  fprintf(fp, "# Blocking parameters of matrixutil for %s\n", host);
+  fprintf(fp, "# type   tile  mc  kc  nc  GFLOP/s\n");
+  fprintf(fp, "float  %dx%d %d %d %d %.2f\n", MR, NR, matrix_tuning.mc,
+	  matrix_tuning.kc, matrix_tuning.nc, gflops);
+  fprintf(fp, "double %dx%d %d %d %d %.2f\n", MR_D, NR_D, matrix_tuning_d.mc,
+	  matrix_tuning_d.kc, matrix_tuning_d.nc, gflops_d);
+  fclose(fp);
+  return(1);
+}
+
+/* Returns the GFLOP/s of the best of three multiplications of the n*n
+   matrices X and Y of the given type with the current parameters */
+static double time_gemm(int type, int n, int threaded, void *X, void *Y,
+			void *Z) {
+  struct timespec t0, t1;
+  double t, best = 1e30;
+  int rep;
+  for (rep=0; rep<3; rep++) {
+    memset(Z, 0, (size_t) matrix_elem_size(type)*n*n);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (type == MATRIX_DOUBLE) {
+      if (threaded) matrixmult_gemm_slice_d(n, n, n, X, n, Y, n, Z, n, 0);
+      else matrixmult_gemm_d(n, n, n, X, n, Y, n, Z, n, 0);
+    } else {
+      if (threaded) matrixmult_gemm_slice(n, n, n, X, n, Y, n, Z, n, 0);
+      else matrixmult_gemm(n, n, n, X, n, Y, n, Z, n, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    t = (t1.tv_sec-t0.tv_sec)+1e-9*(t1.tv_nsec-t0.tv_nsec);
+    if (t < best) best = t;
   }
+  return(2.0*n*n*n/best*1e-9);
 }
 
+/* Finds good blocking parameters for the kernel of the given type by
+   timing multiplications of matrices of order n, with the threaded
+   kernel if threaded is set. Each of kc, mc and nc is varied in turn
+   with the others fixed, and the sweep is repeated once since the best
+   values depend on each other. The best parameters are left in
+   matrix_tuning or matrix_tuning_d and their speed is returned.
+   With verbose set every timing is printed */
+double matrix_autotune(int type, int n, int threaded, int verbose) {
+  static const int kcs[] = { 64, 128, 192, 256, 320, 384, 512, 768 };
+  static const int mcs[] = { 8, 16, 24, 32, 48, 64, 96 };  /* Times mr */
+  static const int ncs[] = { 256, 512, 1024, 2048, 4096, 8192 };
+  const int nk = sizeof(kcs)/sizeof(int), nm = sizeof(mcs)/sizeof(int);
+  const int nn = sizeof(ncs)/sizeof(int);
+  matrix_tuning_t *t = (type == MATRIX_DOUBLE) ? &matrix_tuning_d :
+    &matrix_tuning;
+  int mr = (type == MATRIX_DOUBLE) ? MR_D : MR;
+  int size = matrix_elem_size(type);
+  int pass, param, c, nc, *p, v, best_v;
+  double gflops, best;
+  long i;
+  void *X, *Y, *Z;
+
+  X = malloc((size_t) size*n*n);
+  Y = malloc((size_t) size*n*n);
+  Z = malloc((size_t) size*n*n);
+  if (X == NULL || Y == NULL || Z == NULL) {
+    printf("Couldn't allocate matrices for tuning\n");
+    exit(1);
+  }
+  for (i=0; i<(long) n*n; i++) {
+    set_elem(X, type, i, matrix_random(1, MATRIX_RAND_UNIFORM, i));
+    set_elem(Y, type, i, matrix_random(2, MATRIX_RAND_UNIFORM, i));
+  }
+
+  best = time_gemm(type, n, threaded, X, Y, Z);
+  if (verbose) printf("  start  mc %4d kc %4d nc %5d  %8.2f GFLOP/s\n",
+		      t->mc, t->kc, t->nc, best);
+  for (pass=0; pass<2; pass++) {
+    for (param=0; param<3; param++) {
+      p = (param == 0) ? &t->kc : (param == 1) ? &t->mc : &t->nc;
+      nc = (param == 0) ? nk : (param == 1) ? nm : nn;
+      best_v = *p;
+      for (c=0; c<nc; c++) {
+	v = (param == 0) ? kcs[c] : (param == 1) ? mcs[c]*mr : ncs[c];
+	if (v == best_v) continue;
+	*p = v;
+	gflops = time_gemm(type, n, threaded, X, Y, Z);
+	if (verbose) printf("  pass %d mc %4d kc %4d nc %5d  %8.2f GFLOP/s\n",
+			    pass+1, t->mc, t->kc, t->nc, gflops);
+	if (gflops > best) {
+	  best = gflops;
+	  best_v = v;
+	}
+      }
+      *p = best_v;
+    }
+  }
+  free(X);
+  free(Y);
+  free(Z);
+  return(best);
+}
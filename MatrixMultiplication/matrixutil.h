@@ -1,8 +1,220 @@
+#include <stdint.h>
+
+/* Header of matrix files. The elements, of the type given in the header,
+   follow right after it, at offset MATRIX_HEADER_SIZE in the file */
+#define MATRIX_MAGIC       0x54414d46   /* "FMAT" */
+#define MATRIX_VERSION     1
+#define MATRIX_HEADER_SIZE 64
+
+enum { MATRIX_FLOAT = 1, MATRIX_DOUBLE = 2,     /* Element types */
+       MATRIX_INT8 = 3, MATRIX_INT32 = 4 };
+enum { MATRIX_ROWMAJOR = 0, MATRIX_TILED = 1 }; /* Layouts of the elements */
+
+/* Distributions of the random matrices made by matrix_random */
+enum { MATRIX_RAND_INT = 0, MATRIX_RAND_UNIFORM = 1, MATRIX_RAND_NORMAL = 2 };
+
+typedef struct {
+  uint32_t magic;           /* MATRIX_MAGIC */
+  uint32_t version;         /* MATRIX_VERSION */
+  uint32_t type;            /* Element type, MATRIX_FLOAT etc */
+  uint32_t layout;          /* MATRIX_ROWMAJOR or MATRIX_TILED */
+  uint64_t rows, cols;      /* Size of the matrix */
+  uint64_t tile;            /* Tiles are tile*tile in the tiled layout */
+  uint64_t checksum;        /* Sum of matrix_checksum over all elements */
+  uint64_t reserved[2];
+} matrix_header_t;
+
+/* Blocking parameters of the local multiplication kernels, used when
+   they are called with blocksize<=0. matrix_tuning is for the float
+   kernel, matrix_tuning_d for the double and mixed kernels */
+typedef struct {
+  int mc;                   /* Rows of X in a packed block */
+  int kc;                   /* Columns of X and rows of Y in a packed block */
+  int nc;                   /* Columns of Y in a packed panel */
+} matrix_tuning_t;
+
+extern matrix_tuning_t matrix_tuning, matrix_tuning_d;
 
 extern void write_matrix(float *M, int N);
+extern void write_matrix_d(double *M, int N);
+extern void write_matrix_i8(int8_t *M, int N);
+extern void write_matrix_i32(int32_t *M, int N);
 extern int  fread_matrix(float *M, int N, char *fn);
+extern int  fread_matrix_d(double *M, int N, char *fn);
+extern int  fread_matrix_i8(int8_t *M, int N, char *fn);
 extern int  fwrite_matrix(float *M, int N, char *fn);
+extern int  fwrite_matrix_d(double *M, int N, char *fn);
+extern int  fwrite_matrix_i32(int32_t *M, int N, char *fn);
+extern int  matrix_read(void *M, int type, int rows, int cols, char *fn);
+extern int  matrix_write(const void *M, int type, int rows, int cols,
+                         char *fn);
+extern int  matrix_shape(char *fn, long *rows, long *cols);
+extern int  matrix_elem_size(int type);
+extern void matrix_header(matrix_header_t *hdr, int type, long rows,
+                          long cols, int layout, long tile);
+extern int  matrix_header_ok(const matrix_header_t *hdr);
+extern long matrix_index(const matrix_header_t *hdr, long i, long j);
+extern uint64_t matrix_checksum(const float *M, long n, long first);
+extern uint64_t matrix_checksum_d(const double *M, long n, long first);
+extern uint64_t matrix_checksum_i8(const int8_t *M, long n, long first);
+extern uint64_t matrix_checksum_i32(const int32_t *M, long n, long first);
+extern uint64_t matrix_checksum_type(const void *M, int type, long n,
+                                     long first);
+extern double matrix_get(const void *D, int type, long k);
+extern void *matrix_map(char *fn, matrix_header_t *hdr);
+extern void *matrix_create(char *fn, int type, long rows, long cols,
+                           int layout, long tile);
+extern void matrix_unmap(void *M, int update);
+extern int  matrix_verify(const void *M, const matrix_header_t *hdr);
+extern float matrix_random(uint64_t seed, int dist, uint64_t index);
 extern void matrixmult(float *X, float *Y, float *Z, int N);
+extern void matrixmult_rect(int M, int N, int K, float *X, int ldx, float *Y,
+                            int ldy, float *Z, int ldz);
 extern void matrixmult_block(float *X, float *Y, float *Z, int N, int blocksize);
 extern void matrixmult_slice(float *X, float *Y, float *Z, int N, int blocksize);
+extern void matrixmult_gemm(int M, int N, int K, float *X, int ldx, float *Y,
+                            int ldy, float *Z, int ldz, int blocksize);
+extern void matrixmult_gemm_slice(int M, int N, int K, float *X, int ldx,
+                                  float *Y, int ldy, float *Z, int ldz,
+                                  int blocksize);
+extern void matrixmult_gemm_d(int M, int N, int K, double *X, int ldx,
+                              double *Y, int ldy, double *Z, int ldz,
+                              int blocksize);
+extern void matrixmult_gemm_slice_d(int M, int N, int K, double *X, int ldx,
+                                    double *Y, int ldy, double *Z, int ldz,
+                                    int blocksize);
+extern void matrixmult_gemm_mixed(int M, int N, int K, float *X, int ldx,
+                                  float *Y, int ldy, double *Z, int ldz,
+                                  int blocksize);
+extern void matrixmult_gemm_slice_mixed(int M, int N, int K, float *X,
+                                        int ldx, float *Y, int ldy, double *Z,
+                                        int ldz, int blocksize);
+extern void matrixmult_gemm_i8(int M, int N, int K, int8_t *X, int ldx,
+                               int8_t *Y, int ldy, int32_t *Z, int ldz,
+                               int blocksize);
+extern void matrixmult_gemm_slice_i8(int M, int N, int K, int8_t *X, int ldx,
+                                     int8_t *Y, int ldy, int32_t *Z, int ldz,
+                                     int blocksize);
+extern int  matrix_csr_compress(int M, int N, const float *A, int lda,
+                                int max_nnz, int *rowptr, int *colidx,
+                                float *val);
+extern int  matrix_csr_compress_d(int M, int N, const double *A, int lda,
+                                  int max_nnz, int *rowptr, int *colidx,
+                                  double *val);
+extern int  matrix_csr_compress_i8(int M, int N, const int8_t *A, int lda,
+                                   int max_nnz, int *rowptr, int *colidx,
+                                   int8_t *val);
+extern void matrixmult_csr_dense(int M, int N, const int *rowptr,
+                                 const int *colidx, const float *val,
+                                 const float *Y, int ldy, float *Z, int ldz);
+extern void matrixmult_csr_dense_d(int M, int N, const int *rowptr,
+                                   const int *colidx, const double *val,
+                                   const double *Y, int ldy, double *Z,
+                                   int ldz);
+extern void matrixmult_csr_dense_mixed(int M, int N, const int *rowptr,
+                                       const int *colidx, const float *val,
+                                       const float *Y, int ldy, double *Z,
+                                       int ldz);
+extern void matrixmult_csr_dense_i8(int M, int N, const int *rowptr,
+                                    const int *colidx, const int8_t *val,
+                                    const int8_t *Y, int ldy, int32_t *Z,
+                                    int ldz);
+extern void matrixmult_dense_csr(int M, int K, const float *X, int ldx,
+                                 const int *rowptr, const int *colidx,
+                                 const float *val, float *Z, int ldz);
+extern void matrixmult_dense_csr_d(int M, int K, const double *X, int ldx,
+                                   const int *rowptr, const int *colidx,
+                                   const double *val, double *Z, int ldz);
+extern void matrixmult_dense_csr_mixed(int M, int K, const float *X, int ldx,
+                                       const int *rowptr, const int *colidx,
+                                       const float *val, double *Z, int ldz);
+extern void matrixmult_dense_csr_i8(int M, int K, const int8_t *X, int ldx,
+                                    const int *rowptr, const int *colidx,
+                                    const int8_t *val, int32_t *Z, int ldz);
+extern void matrixmult_csr_csr(int M, const int *arow, const int *acol,
+                               const float *aval, const int *brow,
+                               const int *bcol, const float *bval, float *Z,
+                               int ldz);
+extern void matrixmult_csr_csr_d(int M, const int *arow, const int *acol,
+                                 const double *aval, const int *brow,
+                                 const int *bcol, const double *bval,
+                                 double *Z, int ldz);
+extern void matrixmult_csr_csr_mixed(int M, const int *arow, const int *acol,
+                                     const float *aval, const int *brow,
+                                     const int *bcol, const float *bval,
+                                     double *Z, int ldz);
+extern void matrixmult_csr_csr_i8(int M, const int *arow, const int *acol,
+                                  const int8_t *aval, const int *brow,
+                                  const int *bcol, const int8_t *bval,
+                                  int32_t *Z, int ldz);
+extern long matrix_compress_bound(long n, int size);
+extern long matrix_compress(const void *src, long n, int size,
+                            unsigned char *dst);
+extern long matrix_decompress(const unsigned char *src, long n, int size,
+                              void *dst);
+extern long strassen_worksize(int N, int cutoff);
+extern void matrixmult_strassen(float *X, float *Y, float *Z, int N, int cutoff,
+                                int blocksize, float *work);
 extern void settozero(float *X, int N);
+extern void settozero_rect(float *X, int M, int N, int ldx);
+extern void matrix_profile_name(char *fn, int len);
+extern int  matrix_tuning_load(const char *fn);
+extern int  matrix_tuning_save(const char *fn, double gflops, double gflops_d);
+extern double matrix_autotune(int type, int n, int threaded, int verbose);
+
+/* Type-generic versions of the above, selecting the function from the
+   types of the matrices: floats, doubles, floats multiplied into a
+   matrix of doubles, or int8 multiplied into a matrix of int32 */
+#define MATRIX_TYPE_OF(M) _Generic((M), float *: MATRIX_FLOAT, \
+                                        double *: MATRIX_DOUBLE, \
+                                        int8_t *: MATRIX_INT8, \
+                                        int32_t *: MATRIX_INT32)
+#define write_matrix_t(M, N) \
+  _Generic((M), float *: write_matrix, double *: write_matrix_d, \
+                int8_t *: write_matrix_i8, int32_t *: write_matrix_i32)(M, N)
+#define fread_matrix_t(M, N, fn) \
+  _Generic((M), float *: fread_matrix, double *: fread_matrix_d, \
+                int8_t *: fread_matrix_i8)(M, N, fn)
+#define fwrite_matrix_t(M, N, fn) \
+  _Generic((M), float *: fwrite_matrix, double *: fwrite_matrix_d, \
+                int32_t *: fwrite_matrix_i32)(M, N, fn)
+#define matrix_checksum_t(M, n, first) \
+  _Generic((M), float *: matrix_checksum, \
+                double *: matrix_checksum_d, \
+                int8_t *: matrix_checksum_i8, \
+                int32_t *: matrix_checksum_i32)(M, n, first)
+#define matrixmult_gemm_t(M, N, K, X, ldx, Y, ldy, Z, ldz, bs) \
+  _Generic((Z), float *: matrixmult_gemm, \
+                double *: _Generic((X), double *: matrixmult_gemm_d, \
+                                        default: matrixmult_gemm_mixed), \
+                int32_t *: matrixmult_gemm_i8) \
+  (M, N, K, X, ldx, Y, ldy, Z, ldz, bs)
+#define matrixmult_gemm_slice_t(M, N, K, X, ldx, Y, ldy, Z, ldz, bs) \
+  _Generic((Z), float *: matrixmult_gemm_slice, \
+                double *: _Generic((X), double *: matrixmult_gemm_slice_d, \
+                                        default: matrixmult_gemm_slice_mixed), \
+                int32_t *: matrixmult_gemm_slice_i8) \
+  (M, N, K, X, ldx, Y, ldy, Z, ldz, bs)
+#define matrix_csr_compress_t(M, N, A, lda, max, rowptr, colidx, val) \
+  _Generic((A), float *: matrix_csr_compress, \
+                double *: matrix_csr_compress_d, \
+                int8_t *: matrix_csr_compress_i8) \
+  (M, N, A, lda, max, rowptr, colidx, val)
+#define matrixmult_csr_dense_t(M, N, rowptr, colidx, val, Y, ldy, Z, ldz) \
+  _Generic((Z), float *: matrixmult_csr_dense, \
+                double *: _Generic((Y), double *: matrixmult_csr_dense_d, \
+                                        default: matrixmult_csr_dense_mixed), \
+                int32_t *: matrixmult_csr_dense_i8) \
+  (M, N, rowptr, colidx, val, Y, ldy, Z, ldz)
+#define matrixmult_dense_csr_t(M, K, X, ldx, rowptr, colidx, val, Z, ldz) \
+  _Generic((Z), float *: matrixmult_dense_csr, \
+                double *: _Generic((X), double *: matrixmult_dense_csr_d, \
+                                        default: matrixmult_dense_csr_mixed), \
+                int32_t *: matrixmult_dense_csr_i8) \
+  (M, K, X, ldx, rowptr, colidx, val, Z, ldz)
+#define matrixmult_csr_csr_t(M, arow, acol, aval, brow, bcol, bval, Z, ldz) \
+  _Generic((Z), float *: matrixmult_csr_csr, \
+                double *: _Generic((aval), double *: matrixmult_csr_csr_d, \
+                                           default: matrixmult_csr_csr_mixed), \
+                int32_t *: matrixmult_csr_csr_i8) \
+  (M, arow, acol, aval, brow, bcol, bval, Z, ldz)
@@ -0,0 +1,263 @@
+/* Template for the matrix multiplication kernels of matrixutil.c.
+   It is included once for every element type, with these defined:
+     GEMM_TX       type of the elements of X and Y
+     GEMM_TZ       type of the elements of Z, which the products are
+                   accumulated in. X and Y are converted to it when
+                   they are packed, so the micro-kernel only sees GEMM_TZ
+     GEMM_MR       height of the register tile of the micro-kernel
+     GEMM_NR       width of the register tile of the micro-kernel
+     GEMM_KERNEL   the micro-kernel, for elements of type GEMM_TZ
+     GEMM_NAME(f)  the name of function f for this element type
+     GEMM_TUNING   the matrix_tuning_t with the block sizes to use when
+                   the caller gives no block size
+   and optionally
+     GEMM_TP       type of the packed elements that the micro-kernel
+                   sees, GEMM_TZ if not defined
+     GEMM_KU       nr of consecutive k stored together for every row of
+                   X and column of Y in the packed panels, 1 if not
+                   defined. The micro-kernel then gets kc rounded up to
+                   a multiple of GEMM_KU, with the rest padded with zeros
+   Every element type thus gets its own packing routines and its own
+   vectorized micro-kernel, with no tests of the type in the inner loops.
+   The kernels for sparse matrices at the end are made the same way.
+*/
+
+#ifndef GEMM_TP
+#define GEMM_TP GEMM_TZ
+#endif
+#ifndef GEMM_KU
+#define GEMM_KU 1
+#endif
+
+/* Copies the mc*kc block of X starting at X, with row stride ldx, into
+   micro-panels of MR rows stored column by column, or GEMM_KU columns
+   at a time. Rows past mc and columns past kc are padded with zeros. */
+static void GEMM_NAME(pack_X)(const GEMM_TX *X, int ldx, int mc, int kc,
+                              GEMM_TP *buf) {
+  int i, ir, p, u;
+  for (ir=0; ir<mc; ir+=GEMM_MR) {
+    for (p=0; p<kc; p+=GEMM_KU) {
+      for (i=0; i<GEMM_MR; i++) {
+        for (u=0; u<GEMM_KU; u++) {
+          *buf++ = (ir+i < mc && p+u < kc) ? X[(long) (ir+i)*ldx+p+u] : 0;
+        }
+      }
+    }
+  }
+}
+
+/* Copies the kc*nc block of Y starting at Y, with row stride ldy, into
+   micro-panels of NR columns stored row by row, or GEMM_KU rows at a
+   time. Columns past nc and rows past kc are padded with zeros. */
+static void GEMM_NAME(pack_Y)(const GEMM_TX *Y, int ldy, int kc, int nc,
+                              GEMM_TP *buf) {
+  int j, jr, p, u;
+  for (jr=0; jr<nc; jr+=GEMM_NR) {
+    for (p=0; p<kc; p+=GEMM_KU) {
+      for (u=0; u<GEMM_KU; u++) {
+        const GEMM_TX *y = Y+(long) (p+u)*ldy+jr;
+        if (p+u >= kc) {
+          for (j=0; j<GEMM_NR; j++) buf[j*GEMM_KU+u] = 0;
+        } else if (jr+GEMM_NR <= nc) {
+          for (j=0; j<GEMM_NR; j++) buf[j*GEMM_KU+u] = y[j];
+        } else {
+          for (j=0; j<GEMM_NR; j++)
+            buf[j*GEMM_KU+u] = (jr+j < nc) ? y[j] : 0;
+        }
+      }
+      buf += GEMM_NR*GEMM_KU;
+    }
+  }
+}
+
+
+/* The packing buffers of the calling thread. They are kept between
+   the calls and only grow, so the local multiplications of every stage
+   and every thread of matrixmult_gemm_slice don't allocate them again */
+static _Thread_local GEMM_TP *GEMM_NAME(Xpack), *GEMM_NAME(Ypack);
+static _Thread_local long GEMM_NAME(Xpack_size), GEMM_NAME(Ypack_size);
+
+/* Returns the packing buffer *buf, reallocated if its size *have is
+   less than size elements */
+static GEMM_TP *GEMM_NAME(pack_buffer)(GEMM_TP **buf, long *have,
+                                       long size) {
+  if (size > *have) {
+    free(*buf);
+    if (posix_memalign((void **) buf, 64, sizeof(GEMM_TP)*size)) {
+      printf("Couldn't allocate packing buffers\n");
+      exit(1);
+    }
+    *have = size;
+  }
+  return(*buf);
+}
+
+
+/* Computes Z += X*Y where X is M*K, Y is K*N and Z is M*N, all stored
+   by rows with the row strides ldx, ldy and ldz. Blocks of X of size
+   mc*kc and panels of Y of size kc*nc are copied into contiguous
+   buffers before they are multiplied, so that the micro-kernel streams
+   through memory with unit stride. A positive blocksize sets both mc
+   and kc, otherwise they are taken from GEMM_TUNING. */
+static void GEMM_NAME(block_gemm)(int M, int N, int K, const GEMM_TX *X,
+                                  int ldx, const GEMM_TX *Y, int ldy,
+                                  GEMM_TZ *Z, int ldz, int blocksize) {
+  int mc_max, kc_max, nc_max;
+  int ic, jc, pc, ir, jr, i, j;
+  GEMM_TP *Xbuf, *Ybuf;
+  GEMM_TZ Ztmp[GEMM_MR*GEMM_NR];
+
+  if (blocksize > 0) {
+    kc_max = mc_max = blocksize;
+  } else {
+    kc_max = GEMM_TUNING.kc;
+    mc_max = GEMM_TUNING.mc;
+  }
+  nc_max = GEMM_TUNING.nc;
+  /* Small products, like the leaves and the peeled rows and columns of
+     Strassen's algorithm, need no more room than their size */
+  if (mc_max > M) mc_max = M;
+  if (kc_max > K) kc_max = K;
+  if (nc_max > N) nc_max = N;
+  mc_max = ((mc_max+GEMM_MR-1)/GEMM_MR)*GEMM_MR;
+  kc_max = ((kc_max+GEMM_KU-1)/GEMM_KU)*GEMM_KU;
+
+  Xbuf = GEMM_NAME(pack_buffer)(&GEMM_NAME(Xpack), &GEMM_NAME(Xpack_size),
+                                (long) mc_max*kc_max);
+  Ybuf = GEMM_NAME(pack_buffer)(&GEMM_NAME(Ypack), &GEMM_NAME(Ypack_size),
+                                (long) kc_max*
+                                (((nc_max+GEMM_NR-1)/GEMM_NR)*GEMM_NR));
+
+  for (jc=0; jc<N; jc+=nc_max) {
+    int nc = (N-jc < nc_max) ? N-jc : nc_max;
+    for (pc=0; pc<K; pc+=kc_max) {
+      int kc = (K-pc < kc_max) ? K-pc : kc_max;
+      int kp = ((kc+GEMM_KU-1)/GEMM_KU)*GEMM_KU;   /* kc with the padding */
+      GEMM_NAME(pack_Y)(Y+(long) pc*ldy+jc, ldy, kc, nc, Ybuf);
+      for (ic=0; ic<M; ic+=mc_max) {
+        int mc = (M-ic < mc_max) ? M-ic : mc_max;
+        GEMM_NAME(pack_X)(X+(long) ic*ldx+pc, ldx, mc, kc, Xbuf);
+        for (jr=0; jr<nc; jr+=GEMM_NR) {
+          int nr = (nc-jr < GEMM_NR) ? nc-jr : GEMM_NR;
+          for (ir=0; ir<mc; ir+=GEMM_MR) {
+            int mr = (mc-ir < GEMM_MR) ? mc-ir : GEMM_MR;
+            GEMM_TZ *z = Z+(long) (ic+ir)*ldz+jc+jr;
+            if (mr == GEMM_MR && nr == GEMM_NR) {
+              GEMM_KERNEL(kp, Xbuf+ir*kp, Ybuf+jr*kp, z, ldz);
+            } else {
+              /* Edge tile, compute in a temporary and add the valid part */
+              memset(Ztmp, 0, sizeof(Ztmp));
+              GEMM_KERNEL(kp, Xbuf+ir*kp, Ybuf+jr*kp, Ztmp, GEMM_NR);
+              for (i=0; i<mr; i++)
+                for (j=0; j<nr; j++) z[(long) i*ldz+j] += Ztmp[i*GEMM_NR+j];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+
+/* Multiplies the M*K matrix X with the K*N matrix Y and adds the result
+   to the M*N matrix Z. The matrices are stored by rows, with ldx, ldy
+   and ldz elements between the starts of two rows, so they can be parts
+   of bigger matrices. Uses the same blocked kernel as matrixmult_block */
+void GEMM_NAME(matrixmult_gemm)(int M, int N, int K, GEMM_TX *X, int ldx,
+                                GEMM_TX *Y, int ldy, GEMM_TZ *Z, int ldz,
+                                int blocksize) {
+  GEMM_NAME(block_gemm)(M, N, K, X, ldx, Y, ldy, Z, ldz, blocksize);
+}
+
+
+/* As matrixmult_gemm, but using all OpenMP threads. The rows of Z are
+   split into one slice per thread, in multiples of the micro-kernel
+   height, and each thread computes its slice with the blocked kernel */
+void GEMM_NAME(matrixmult_gemm_slice)(int M, int N, int K, GEMM_TX *X,
+                                      int ldx, GEMM_TX *Y, int ldy,
+                                      GEMM_TZ *Z, int ldz, int blocksize) {
+#ifdef _OPENMP
+#pragma omp parallel
+  {
+    int nthreads = omp_get_num_threads();
+    int id = omp_get_thread_num();
+    int tiles = (M+GEMM_MR-1)/GEMM_MR;   /* Nr of row tiles to share */
+    int first = (int) ((long) tiles*id/nthreads)*GEMM_MR;
+    int last = (int) ((long) tiles*(id+1)/nthreads)*GEMM_MR;
+    if (last > M) last = M;
+    if (first < last)
+      GEMM_NAME(block_gemm)(last-first, N, K, X+(long) first*ldx, ldx, Y, ldy,
+                            Z+(long) first*ldz, ldz, blocksize);
+  }
+#else
+  GEMM_NAME(block_gemm)(M, N, K, X, ldx, Y, ldy, Z, ldz, blocksize);
+#endif
+}
+
+
+/* Kernels for sparse matrices in compressed sparse row (CSR) format.
+   The nonzeros of row i are val[rowptr[i]] to val[rowptr[i+1]-1], and
+   colidx holds their column indexes. The products are added to a dense
+   Z with row stride ldz, and the work is proportional to the number of
+   nonzeros instead of the size of the matrices. */
+
+/* Z += A*Y where A is an M*K sparse matrix and Y a dense K*N matrix.
+   Each nonzero a_ik adds a_ik times row k of Y to row i of Z */
+void GEMM_NAME(matrixmult_csr_dense)(int M, int N, const int *rowptr,
+                                     const int *colidx, const GEMM_TX *val,
+                                     const GEMM_TX *Y, int ldy, GEMM_TZ *Z,
+                                     int ldz) {
+  int i, j, p;
+  for (i=0; i<M; i++) {
+    GEMM_TZ *z = Z+(long) i*ldz;
+    for (p=rowptr[i]; p<rowptr[i+1]; p++) {
+      const GEMM_TX *y = Y+(long) colidx[p]*ldy;
+      GEMM_TZ a = val[p];
+      for (j=0; j<N; j++) z[j] += a*y[j];
+    }
+  }
+}
+
+/* Z += X*B where X is a dense M*K matrix and B a K*N sparse matrix.
+   Each element x_ik that is not zero adds x_ik times the sparse row k
+   of B to row i of Z */
+void GEMM_NAME(matrixmult_dense_csr)(int M, int K, const GEMM_TX *X, int ldx,
+                                     const int *rowptr, const int *colidx,
+                                     const GEMM_TX *val, GEMM_TZ *Z, int ldz) {
+  int i, k, p;
+  for (i=0; i<M; i++) {
+    GEMM_TZ *z = Z+(long) i*ldz;
+    for (k=0; k<K; k++) {
+      GEMM_TZ x = X[(long) i*ldx+k];
+      if (x == 0) continue;
+      for (p=rowptr[k]; p<rowptr[k+1]; p++) z[colidx[p]] += x*val[p];
+    }
+  }
+}
+
+/* Z += A*B where A is an M*K and B a K*N sparse matrix. Each nonzero
+   a_ik adds a_ik times the sparse row k of B to row i of Z */
+void GEMM_NAME(matrixmult_csr_csr)(int M, const int *arow, const int *acol,
+                                   const GEMM_TX *aval, const int *brow,
+                                   const int *bcol, const GEMM_TX *bval,
+                                   GEMM_TZ *Z, int ldz) {
+  int i, p, r;
+  for (i=0; i<M; i++) {
+    GEMM_TZ *z = Z+(long) i*ldz;
+    for (p=arow[i]; p<arow[i+1]; p++) {
+      GEMM_TZ a = aval[p];
+      int k = acol[p];
+      for (r=brow[k]; r<brow[k+1]; r++) z[bcol[r]] += a*bval[r];
+    }
+  }
+}
+
+#undef GEMM_TX
+#undef GEMM_TZ
+#undef GEMM_MR
+#undef GEMM_NR
+#undef GEMM_KERNEL
+#undef GEMM_NAME
+#undef GEMM_TUNING
+#undef GEMM_TP
+#undef GEMM_KU
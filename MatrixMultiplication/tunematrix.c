@@ -0,0 +1,104 @@
+/* Program that finds good blocking parameters for the local matrix   */
+/* multiplication kernels of matrixutil.c on this host and stores     */
+/* them in a profile, which fox loads when it starts. It only has to  */
+/* be run once on every type of node, as in                           */
+/*   tunematrix -n 1024 -t 16                                         */
+/* The block sizes mc, kc and nc of the kernels for floats and for    */
+/* doubles are varied in turn and the fastest ones are kept. The      */
+/* profile is $HOME/.matrixtune.<hostname> unless another file is     */
+/* given with -o or in the environment variable MATRIX_PROFILE.       */
+/* With -t nthreads the threaded kernel used in fox's hybrid mode is  */
+/* tuned, with that many threads, otherwise the single thread kernel. */
+
+/* Compile with  gcc -O3 -march=native -fopenmp tunematrix.c matrixutil.o -o tunematrix -lm  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "matrixutil.h"
+
+
+int main(int argc, char** argv) {
+
+  int N = 1024;        /* Size of the matrices that are multiplied */
+  int nthreads = 0;    /* Threads for the threaded kernel, 0 = single */
+  int verbose = 0;     /* Print every timing */
+  int types = 3;       /* Bit 1 float, bit 2 double */
+  double gflops = 0.0, gflops_d = 0.0;
+  char fn[256];
+  int c;
+
+  matrix_profile_name(fn, sizeof(fn));
+
+  /* Parse arguments */
+  while ((c=getopt(argc, argv, "hn:o:t:T:v")) != -1) {
+    switch (c) {
+    case 'n':
+      N = atoi(optarg);
+      break;
+    case 'o':
+      strncpy(fn, optarg, 255);
+      fn[255] = '\0';
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 'T':
+      if (!strcmp(optarg, "float")) types = 1;
+      else if (!strcmp(optarg, "double")) types = 2;
+      else {
+	printf("Unknown element type %s\n", optarg);
+	exit(1);
+      }
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'h':
+      printf("Usage: tunematrix [-n N] [-o file] [-t nthreads] [-T type] [-v]\n");
+      printf("       where\n");
+      printf("        -n N        -- size of the matrices to time, default 1024\n");
+      printf("        -o file     -- profile to write, default %s\n", fn);
+      printf("        -t nthreads -- tune the threaded kernel with nthreads threads\n");
+      printf("        -T type     -- only tune the kernel for float or double\n");
+      printf("        -v          -- verbose, print every timing\n");
+      printf("        -h          -- help, print this message\n\n");
+      exit(0);
+    }
+  }
+  if (N <= 0) {
+    printf("The size must be positive\n");
+    exit(1);
+  }
+#ifdef _OPENMP
+  if (nthreads > 0) omp_set_num_threads(nthreads);
+#else
+  nthreads = 0;
+#endif
+
+  /* Start from the profile there is, so that tuning only one of the */
+  /* types keeps the parameters of the other */
+  if (matrix_tuning_load(fn) > 0) printf("Starting from profile %s\n", fn);
+
+  if (types & 1) {
+    printf("Tuning the float kernel with N = %d\n", N);
+    gflops = matrix_autotune(MATRIX_FLOAT, N, nthreads > 0, verbose);
+    printf("  mc %d kc %d nc %d, %.2f GFLOP/s\n", matrix_tuning.mc,
+	   matrix_tuning.kc, matrix_tuning.nc, gflops);
+  }
+  if (types & 2) {
+    printf("Tuning the double kernel with N = %d\n", N);
+    gflops_d = matrix_autotune(MATRIX_DOUBLE, N, nthreads > 0, verbose);
+    printf("  mc %d kc %d nc %d, %.2f GFLOP/s\n", matrix_tuning_d.mc,
+	   matrix_tuning_d.kc, matrix_tuning_d.nc, gflops_d);
+  }
+
+  if (!matrix_tuning_save(fn, gflops, gflops_d)) exit(1);
+  printf("Wrote profile %s\n\n", fn);
+  exit(0);
+}